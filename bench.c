@@ -0,0 +1,375 @@
+#include "common/data.h"
+#include <poll.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Gerador de carga: lança N clientes (processos, cada um com o seu pipe, como
+// o ./cliente) que falam o protocolo do controlador e mede a latência de cada
+// pedido. Com a mesma semente e parâmetros a sequência de pedidos é a mesma.
+
+// --- Constantes ---
+#define BENCH_DEFAULT_CLIENTS 10
+#define BENCH_DEFAULT_CYCLES 200
+#define BENCH_RIDE_HOUR 1000000     // Longe no futuro: as viagens nunca são despachadas
+#define BENCH_TIMEOUT_MS 5000       // Sem resposta durante este tempo: o cliente desiste
+#define BENCH_NUM_TYPES (TERMINATE_REQ + 1)
+
+// --- Estruturas ---
+typedef struct {
+    int64_t latency_ns;
+    uint8_t type;        // RequestType
+    uint8_t success;     // FRAME_F_SUCCESS na resposta
+} BenchSample;
+
+// Resultado de cada cliente (memória partilhada com o processo pai)
+typedef struct {
+    int count;           // Amostras válidas
+    int timed_out;       // 1 se desistiu por falta de resposta
+    int shutdown;        // 1 se o controlador encerrou a meio
+} BenchClientResult;
+
+// --- Variáveis Globais ---
+int num_clients = BENCH_DEFAULT_CLIENTS;
+int num_cycles = BENCH_DEFAULT_CYCLES;   // Ciclos agendar/consultar/cancelar por cliente
+int consults_per_cycle = 1;
+double rate = 0;                         // Pedidos/s por cliente (0 = sem pausa)
+unsigned seed = 1;
+int samples_per_client;
+BenchSample* samples = NULL;             // num_clients * samples_per_client
+BenchClientResult* results = NULL;
+
+// Estado do cliente (processo filho)
+int server_fd = -1;
+int my_fd = -1;
+pid_t my_pid;
+char my_name[50];
+char my_pipe_path[50];
+
+const char* places[] = {
+    "lisboa", "porto", "coimbra", "braga", "faro", "aveiro", "setubal", "evora",
+    "leiria", "viseu", "sintra", "cascais", "guimaraes", "braganca", "beja", "santarem",
+};
+const int num_places = sizeof(places) / sizeof(places[0]);
+
+// --- Protótipos ---
+void usage(const char* prog);
+void run_client(int client_idx);
+int bench_request(RequestType type, const char* data, char* reply, size_t reply_size,
+                  const struct timespec* intended, BenchSample* sample);
+void send_request(RequestType type, const char* data);
+int read_reply(char* reply, size_t reply_size, int* success);
+void pace(struct timespec* next);
+int64_t elapsed_ns(const struct timespec* from, const struct timespec* to);
+int compare_latency(const void* a, const void* b);
+void report(double wall_s);
+void report_line(const char* label, int64_t* latencies, int count, int refused);
+const char* type_label(int type);
+
+// --- Main ---
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:k:r:s:h")) != -1) {
+        switch (opt) {
+            case 'c': num_clients = atoi(optarg); break;
+            case 'n': num_cycles = atoi(optarg); break;
+            case 'k': consults_per_cycle = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 's': seed = (unsigned)strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (num_clients < 1 || num_cycles < 0 || consults_per_cycle < 0 || rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (access(PIPE_SERVER, F_OK) == -1) {
+        printf("[BENCH] Erro: Controlador offline.\n");
+        return 1;
+    }
+
+    // Login + ciclos (agendar, consultas, cancelar) + terminar
+    samples_per_client = 2 + num_cycles * (2 + consults_per_cycle);
+    size_t samples_bytes = (size_t)num_clients * samples_per_client * sizeof(BenchSample);
+    samples = mmap(NULL, samples_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    results = mmap(NULL, num_clients * sizeof(BenchClientResult), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED || results == MAP_FAILED) {
+        perror("[BENCH] Erro ao alocar amostras");
+        return 1;
+    }
+
+    printf("[BENCH] %d cliente(s), %d ciclo(s) de agendar/%d consulta(s)/cancelar, semente %u\n",
+           num_clients, num_cycles, consults_per_cycle, seed);
+    if (rate > 0) {
+        printf("[BENCH] Ritmo por cliente: %.1f pedidos/s\n", rate);
+    } else {
+        printf("[BENCH] Ritmo livre: cada cliente envia o pedido seguinte assim que recebe a resposta\n");
+    }
+    fflush(stdout);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < num_clients; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("[BENCH] Erro ao lançar cliente");
+            num_clients = i;
+            break;
+        }
+        if (pid == 0) {
+            run_client(i);
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {}
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report(elapsed_ns(&start, &end) / 1e9);
+
+    int failed = 0;
+    for (int i = 0; i < num_clients; i++) {
+        if (results[i].timed_out || results[i].shutdown) failed = 1;
+    }
+    return failed;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr, "Uso: %s [-c clientes] [-n ciclos] [-k consultas por ciclo] [-r pedidos/s por cliente] [-s semente]\n",
+            prog);
+}
+
+// --- Cliente Simulado (processo filho) ---
+void run_client(int client_idx) {
+    BenchSample* mine = samples + (size_t)client_idx * samples_per_client;
+    BenchClientResult* result = &results[client_idx];
+    unsigned rng = seed * 2654435761u + client_idx;  // Sequência própria e repetível
+
+    my_pid = getpid();
+    snprintf(my_name, sizeof(my_name), "bench%d_%d", client_idx, my_pid);
+    sprintf(my_pipe_path, PIPE_CLIENT_FMT, my_pid);
+    if (mkfifo(my_pipe_path, 0666) == -1 && errno != EEXIST) {
+        perror("[BENCH] Erro ao criar pipe");
+        result->timed_out = 1;
+        return;
+    }
+    // O_RDWR: o pipe nunca dá EOF, e o controlador consegue abri-lo sem bloquear
+    my_fd = open(my_pipe_path, O_RDWR);
+    server_fd = open(PIPE_SERVER, O_WRONLY);
+    if (my_fd == -1 || server_fd == -1) {
+        perror("[BENCH] Erro ao abrir pipes");
+        unlink(my_pipe_path);
+        result->timed_out = 1;
+        return;
+    }
+
+    char reply[BUFFER_SIZE * 4];
+    char data[BUFFER_SIZE];
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    int r = bench_request(LOGIN_REQ, "", reply, sizeof(reply), &next, &mine[result->count]);
+    if (r == 0) result->count++;
+    if (r == 0 && !mine[0].success) r = -1;  // Login recusado: não há sessão
+
+    for (int cycle = 0; cycle < num_cycles && r == 0; cycle++) {
+        // Agendar: local, destino e distância da sequência do cliente
+        pace(&next);
+        const char* origem = places[rand_r(&rng) % num_places];
+        const char* destino = places[rand_r(&rng) % num_places];
+        int distance = 1 + rand_r(&rng) % 50;
+        snprintf(data, sizeof(data), "%d %s %d %s", BENCH_RIDE_HOUR + cycle, origem, distance, destino);
+        r = bench_request(RIDE_REQ, data, reply, sizeof(reply), &next, &mine[result->count]);
+        if (r != 0) break;
+        result->count++;
+
+        int service_id = 0;  // Sem ID: cancelar todos os serviços agendados
+        sscanf(reply, "Serviço agendado com ID %d", &service_id);
+
+        for (int k = 0; k < consults_per_cycle && r == 0; k++) {
+            pace(&next);
+            r = bench_request(CONSULT_REQ, "", reply, sizeof(reply), &next, &mine[result->count]);
+            if (r == 0) result->count++;
+        }
+        if (r != 0) break;
+
+        pace(&next);
+        snprintf(data, sizeof(data), "%d", service_id);
+        r = bench_request(CANCEL_REQ, data, reply, sizeof(reply), &next, &mine[result->count]);
+        if (r == 0) result->count++;
+    }
+
+    if (r == 0) {
+        pace(&next);
+        r = bench_request(TERMINATE_REQ, "", reply, sizeof(reply), &next, &mine[result->count]);
+        if (r == 0) result->count++;
+    } else if (r == -2) {
+        send_request(TERMINATE_REQ, "");  // Não deixar a sessão aberta no controlador
+    }
+
+    if (r == -2) result->timed_out = 1;
+    if (r == -3) result->shutdown = 1;
+    close(server_fd);
+    close(my_fd);
+    unlink(my_pipe_path);
+}
+
+// --- Pedido Medido (0 se houve resposta, -2 sem resposta, -3 controlador encerrou) ---
+// A latência conta a partir da hora prevista de envio: se o controlador
+// atrasar um pedido, o atraso dos seguintes também é medido.
+int bench_request(RequestType type, const char* data, char* reply, size_t reply_size,
+                  const struct timespec* intended, BenchSample* sample) {
+    send_request(type, data);
+
+    int success;
+    int r = read_reply(reply, reply_size, &success);
+    if (r != 0) return r;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sample->latency_ns = elapsed_ns(intended, &now);
+    sample->type = (uint8_t)type;
+    sample->success = (uint8_t)success;
+    return 0;
+}
+
+void send_request(RequestType type, const char* data) {
+    // Payload: nome ('\0' incluído) seguido dos dados, como o ./cliente
+    char payload[FRAME_MAX_PAYLOAD];
+    size_t name_len = strlen(my_name) + 1;
+    size_t data_len = strlen(data);
+    if (name_len + data_len > FRAME_MAX_PAYLOAD) {
+        data_len = FRAME_MAX_PAYLOAD - name_len;
+    }
+    memcpy(payload, my_name, name_len);
+    memcpy(payload + name_len, data, data_len);
+    frame_write(server_fd, (uint8_t)type, 0, my_pid, payload, name_len + data_len);
+}
+
+// Lê uma resposta completa (todos os frames até ao último sem FRAME_F_MORE)
+int read_reply(char* reply, size_t reply_size, int* success) {
+    FrameHeader hdr;
+    char text[FRAME_MAX_PAYLOAD + 1];
+    size_t used = 0;
+    reply[0] = '\0';
+
+    while (1) {
+        struct pollfd pfd = { my_fd, POLLIN, 0 };
+        int r = poll(&pfd, 1, BENCH_TIMEOUT_MS);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) return -2;
+
+        ssize_t len = frame_read(my_fd, &hdr, text, FRAME_MAX_PAYLOAD);
+        if (len < 0) return -2;
+        if (hdr.opcode != OP_RESPONSE) continue;
+        text[len] = '\0';
+
+        if (used == 0 && strcmp(text, "SERVER_SHUTDOWN") == 0) return -3;
+
+        // Guardar o início do texto (chega para extrair o ID do serviço)
+        size_t copy = (size_t)len < reply_size - 1 - used ? (size_t)len : reply_size - 1 - used;
+        memcpy(reply + used, text, copy);
+        used += copy;
+        reply[used] = '\0';
+
+        if (!(hdr.flags & FRAME_F_MORE)) {
+            *success = (hdr.flags & FRAME_F_SUCCESS) != 0;
+            return 0;
+        }
+    }
+}
+
+// --- Ritmo Fixo (-r): esperar pela hora prevista do próximo pedido ---
+void pace(struct timespec* next) {
+    if (rate <= 0) {
+        clock_gettime(CLOCK_MONOTONIC, next);
+        return;
+    }
+
+    long interval_ns = (long)(1e9 / rate);
+    next->tv_sec += interval_ns / 1000000000;
+    next->tv_nsec += interval_ns % 1000000000;
+    if (next->tv_nsec >= 1000000000) {
+        next->tv_sec++;
+        next->tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR) {}
+}
+
+int64_t elapsed_ns(const struct timespec* from, const struct timespec* to) {
+    return (int64_t)(to->tv_sec - from->tv_sec) * 1000000000 + (to->tv_nsec - from->tv_nsec);
+}
+
+// --- Relatório ---
+int compare_latency(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+void report(double wall_s) {
+    int total = 0;
+    int timed_out = 0;
+    int shutdown = 0;
+    for (int i = 0; i < num_clients; i++) {
+        total += results[i].count;
+        timed_out += results[i].timed_out;
+        shutdown += results[i].shutdown;
+    }
+
+    int64_t* latencies = malloc((total > 0 ? total : 1) * sizeof(int64_t));
+    if (latencies == NULL) {
+        perror("[BENCH] Erro ao alocar relatório");
+        return;
+    }
+
+    printf("[BENCH] %d pedido(s) em %.3f s: %.0f pedidos/s\n", total, wall_s,
+           wall_s > 0 ? total / wall_s : 0.0);
+    printf("[BENCH] %-10s %8s %10s %10s %10s %10s %9s\n",
+           "Pedido", "n", "p50 (us)", "p99 (us)", "p999 (us)", "máx (us)", "recusados");
+
+    // Uma linha por tipo de pedido e uma com todos (type == -1)
+    for (int type = 0; type <= BENCH_NUM_TYPES; type++) {
+        int want = type < BENCH_NUM_TYPES ? type : -1;
+        int count = 0;
+        int refused = 0;
+        for (int i = 0; i < num_clients; i++) {
+            BenchSample* mine = samples + (size_t)i * samples_per_client;
+            for (int j = 0; j < results[i].count; j++) {
+                if (want != -1 && mine[j].type != want) continue;
+                latencies[count++] = mine[j].latency_ns;
+                if (!mine[j].success) refused++;
+            }
+        }
+        if (count > 0) report_line(type_label(want), latencies, count, refused);
+    }
+    free(latencies);
+
+    if (timed_out > 0) printf("[BENCH] AVISO: %d cliente(s) sem resposta durante %d ms\n", timed_out, BENCH_TIMEOUT_MS);
+    if (shutdown > 0) printf("[BENCH] AVISO: O controlador encerrou durante o teste (%d cliente(s))\n", shutdown);
+    fflush(stdout);
+}
+
+void report_line(const char* label, int64_t* latencies, int count, int refused) {
+    qsort(latencies, count, sizeof(int64_t), compare_latency);
+    // Percentil p: posição (n-1)*p da lista ordenada
+    int64_t p50 = latencies[(count - 1) * 50 / 100];
+    int64_t p99 = latencies[(int)((count - 1) * 0.99)];
+    int64_t p999 = latencies[(int)((count - 1) * 0.999)];
+    printf("[BENCH] %-10s %8d %10.1f %10.1f %10.1f %10.1f %9d\n", label, count,
+           p50 / 1e3, p99 / 1e3, p999 / 1e3, latencies[count - 1] / 1e3, refused);
+}
+
+const char* type_label(int type) {
+    switch (type) {
+        case LOGIN_REQ:     return "LOGIN";
+        case RIDE_REQ:      return "AGENDAR";
+        case CANCEL_REQ:    return "CANCELAR";
+        case CONSULT_REQ:   return "CONSULTAR";
+        case TERMINATE_REQ: return "TERMINAR";
+        default:            return "TOTAL";
+    }
+}
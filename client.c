@@ -1,4 +1,5 @@
 #include "common/data.h"
+#include <poll.h>
 
 // --- Variáveis Globais ---
 char my_pipe_path[50];
@@ -7,14 +8,24 @@ int my_fd = -1;
 pid_t my_pid;
 char my_name[50];
 
-// Controlo de Login e Threads
-volatile int login_status = 0;
+// Estado da Sessão (um único loop de eventos trata o stdin e o pipe de respostas)
+int login_status = 0;
 volatile int keep_running = 1;
-pthread_t t_reader;
+char response_buffer[2 * FRAME_MAX_SIZE];  // Bytes lidos que ainda não formam um frame completo
+size_t response_size = 0;
+int response_continuing = 0;  // O frame anterior tinha FRAME_F_MORE
+char input_line[256];         // Linha de comando ainda sem '\n'
+size_t input_size = 0;
+int signal_pipe[2] = { -1, -1 };  // Self-pipe: o handler de SIGINT só escreve aqui
 
 // --- Protótipos ---
 void cleanup_and_exit(int signal);
-void* server_response_listener(void* arg);
+void handle_sigint(int signal);
+void event_loop();
+void read_responses();
+void handle_response(const FrameHeader* hdr, const char* text);
+int read_input();
+int handle_command(char* line);
 void send_request(RequestType type, char* data);
 
 // --- Main ---
@@ -27,8 +38,19 @@ int main(int argc, char *argv[]) {
     my_pid = getpid();
     strcpy(my_name, argv[1]);
     
-    // Tratamento de Sinais (CTRL+C)
-    signal(SIGINT, cleanup_and_exit);
+    // Tratamento de Sinais (CTRL+C): o loop de eventos vê o self-pipe e termina a sessão.
+    // Sem SA_RESTART: um open bloqueado à espera do controlador também é interrompido.
+    if (pipe(signal_pipe) == -1) {
+        perror("[CLIENTE] Erro ao criar pipe de sinais");
+        exit(1);
+    }
+    fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
 
     // 1. Criar Pipe Próprio
     sprintf(my_pipe_path, PIPE_CLIENT_FMT, my_pid);
@@ -39,9 +61,10 @@ int main(int argc, char *argv[]) {
 
     printf("[CLIENTE %s] Iniciado (PID: %d)...\n", my_name, my_pid);
 
-    // 2. Abrir Pipe Próprio 
-    if (pthread_create(&t_reader, NULL, server_response_listener, NULL) != 0) {
-        perror("[CLIENTE] Erro ao criar thread de leitura");
+    // 2. Abrir Pipe Próprio (antes do login: o controlador abre-o sem bloquear)
+    my_fd = open(my_pipe_path, O_RDWR | O_NONBLOCK);
+    if (my_fd == -1) {
+        perror("[CLIENTE] Erro ao abrir pipe");
         unlink(my_pipe_path);
         exit(1);
     }
@@ -49,7 +72,7 @@ int main(int argc, char *argv[]) {
     // 3. Conectar ao Servidor
     server_fd = open(PIPE_SERVER, O_WRONLY);
     if (server_fd == -1) {
-        printf("[CLIENTE] Erro: Controlador offline.\n");
+        if (errno != EINTR) printf("[CLIENTE] Erro: Controlador offline.\n");
         keep_running = 0;
         unlink(my_pipe_path);
         return 1;
@@ -58,103 +81,202 @@ int main(int argc, char *argv[]) {
     // 4. Enviar Login
     send_request(LOGIN_REQ, "");
 
-    // 5. Esperar Resposta do Login
-    while (login_status == 0 && keep_running) {
-        usleep(10000);
-    }
+    // 5. Esperar Resposta do Login e depois tratar comandos e respostas
+    event_loop();
 
     if (login_status == -1) {
-        keep_running = 0;
-        cleanup_and_exit(0);
+        keep_running = 0;  // Sem sessão no controlador: nada a terminar
     }
+    // Fim do stdin ou CTRL+C com a sessão aberta: cleanup_and_exit ainda pede a saída
+    cleanup_and_exit(0);
+    return 0;
+}
 
-    // 6. Loop Principal (Interface)
-    char buffer[256];
-    while (keep_running) {
-        printf("\r\033[KCMD> ");
-        if (fgets(buffer, sizeof(buffer), stdin) == NULL) break;
-        buffer[strcspn(buffer, "\n")] = 0;
+// --- Loop de Eventos (sinais, pipe de respostas e, depois do login, o stdin) ---
+void event_loop() {
+    struct pollfd fds[3];
+    fds[0].fd = signal_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = my_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = STDIN_FILENO;
+    fds[2].events = POLLIN;
 
-        if (strcmp(buffer, "terminar") == 0) {
-            keep_running = 0;
-        }
-        else if (strncmp(buffer, "agendar ", 8) == 0) {
-            // agendar <hora> <local> <distancia>
-            send_request(RIDE_REQ, buffer + 8);
+    while (keep_running) {
+        // Antes do login só interessa a resposta do controlador
+        int nfds = login_status == 1 ? 3 : 2;
+        int r = poll(fds, nfds, -1);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            perror("[CLIENTE] Erro no poll");
+            return;
         }
-        else if (strncmp(buffer, "cancelar ", 9) == 0) {
-            // cancelar <id>
-            send_request(CANCEL_REQ, buffer + 9);
+
+        // CTRL+C: a main termina a sessão, fora do handler
+        if (fds[0].revents & POLLIN) return;
+        if (fds[1].revents & POLLIN) {
+            read_responses();
+            if (login_status == -1) return;
         }
-        else if (strcmp(buffer, "consultar") == 0) {
-            // consultar
-            send_request(CONSULT_REQ, "");
+        if (nfds == 3 && (fds[2].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if (read_input() == -1) return;  // Fim do stdin
         }
-        else if (strlen(buffer) > 0) {
-            printf("[CLIENTE] Comandos disponíveis:\n");
-            printf("  agendar <hora> <local> <distancia>\n");
-            printf("  cancelar <id>\n");
-            printf("  consultar\n");
-            printf("  terminar\n");
+    }
+}
+
+// --- Ler Respostas Disponíveis (frames incompletos ficam para a próxima leitura) ---
+void read_responses() {
+    while (1) {
+        ssize_t n = read(my_fd, response_buffer + response_size, sizeof(response_buffer) - response_size);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;  // EAGAIN: pipe vazio
+        response_size += n;
+
+        size_t offset = 0;
+        while (response_size - offset >= sizeof(FrameHeader)) {
+            FrameHeader hdr;
+            memcpy(&hdr, response_buffer + offset, sizeof(FrameHeader));
+            if (hdr.magic != FRAME_MAGIC || hdr.length > FRAME_MAX_PAYLOAD) {
+                offset = response_size;  // Fluxo corrompido: descartar o que foi lido
+                break;
+            }
+            if (response_size - offset < sizeof(FrameHeader) + hdr.length) break;
+
+            char text[FRAME_MAX_PAYLOAD + 1];
+            memcpy(text, response_buffer + offset + sizeof(FrameHeader), hdr.length);
+            text[hdr.length] = '\0';
+            offset += sizeof(FrameHeader) + hdr.length;
+            if (hdr.opcode == OP_RESPONSE) handle_response(&hdr, text);
         }
+        memmove(response_buffer, response_buffer + offset, response_size - offset);
+        response_size -= offset;
     }
+    fflush(stdout);
+}
 
-    cleanup_and_exit(0);
-    return 0;
+// --- Tratar uma Resposta do Controlador (ou de um veículo) ---
+void handle_response(const FrameHeader* hdr, const char* text) {
+    int success = (hdr->flags & FRAME_F_SUCCESS) != 0;
+    int more = (hdr->flags & FRAME_F_MORE) != 0;
+
+    if (!response_continuing && strcmp(text, "SERVER_SHUTDOWN") == 0) {
+        printf("\n\r\033[K[CLIENTE] O Servidor encerrou. A sair...\n");
+        keep_running = 0;
+        if (server_fd != -1) close(server_fd);
+        if (my_fd != -1) close(my_fd);
+        unlink(my_pipe_path);
+        exit(0);
+    }
+
+    if (login_status == 0) {
+        if (success) {
+            printf("\r\033[K[CLIENTE] Login Sucesso: %s\nCMD> ", text);
+            login_status = 1;
+        } else {
+            printf("\r\033[K[CLIENTE] Login Falhou: %s\n", text);
+            login_status = -1;
+        }
+    } else if (!response_continuing && success && strcmp(text, "Até breve!") == 0) {
+        // Saída aceite pelo controlador (recusada se estiver em viagem: a sessão continua)
+        printf("\r\033[K[CLIENTE] Msg do Server: %s\n", text);
+        keep_running = 0;
+    } else {
+        // Textos longos chegam em vários frames: imprimir o prefixo só no primeiro
+        if (!response_continuing) printf("\r\033[K[CLIENTE] Msg do Server: ");
+        printf("%s", text);
+        if (!more) printf("\nCMD> ");
+        response_continuing = more;
+    }
 }
 
-// --- Thread que ouve o Controlador ---
-void* server_response_listener(void* arg) {
-    my_fd = open(my_pipe_path, O_RDWR); 
-    if (my_fd == -1) {
-        perror("[CLIENTE THREAD] Erro ao abrir pipe");
-        exit(1);
+// --- Ler Comandos do stdin (-1 para sair: fim do stdin ou controlador morreu) ---
+int read_input() {
+    ssize_t n = read(STDIN_FILENO, input_line + input_size, sizeof(input_line) - 1 - input_size);
+    if (n == -1) return errno == EINTR ? 0 : -1;
+    if (n == 0) {
+        // Fim do stdin: a última linha pode não ter '\n'
+        input_line[input_size] = '\0';
+        if (input_size > 0) handle_command(input_line);
+        return -1;
     }
+    input_size += n;
 
-    ControllerResponse resp;
-    while (keep_running) {
-        if (read(my_fd, &resp, sizeof(ControllerResponse)) > 0) {
-            if (strcmp(resp.message, "SERVER_SHUTDOWN") == 0) {
-                printf("\n\r\033[K[CLIENTE] O Servidor encerrou. A sair...\n");
-                keep_running = 0;
-                if (server_fd != -1) close(server_fd);
-                if (my_fd != -1) close(my_fd);
-                unlink(my_pipe_path);
-                exit(0);
-            }
+    char* start = input_line;
+    char* newline;
+    while ((newline = memchr(start, '\n', input_line + input_size - start)) != NULL) {
+        *newline = '\0';
+        if (handle_command(start) == -1) return -1;
+        start = newline + 1;
+    }
 
-            if (login_status == 0) {
-                if (resp.success) {
-                    printf("\r\033[K[CLIENTE] Login Sucesso: %s\nCMD> ", resp.message);
-                    login_status = 1;
-                } else {
-                    printf("\r\033[K[CLIENTE] Login Falhou: %s\n", resp.message);
-                    login_status = -1;
-                }
-                fflush(stdout);
-            } else {
-                printf("\r\033[K[CLIENTE] Msg do Server: %s\nCMD> ", resp.message);
-                fflush(stdout);
-            }
-        }
+    size_t rest = input_line + input_size - start;
+    if (rest == sizeof(input_line) - 1) {
+        // Linha maior que o buffer: tratada em pedaços, como fazia o fgets
+        input_line[rest] = '\0';
+        input_size = 0;
+        return handle_command(input_line);
+    }
+    memmove(input_line, start, rest);
+    input_size = rest;
+    return 0;
+}
+
+// --- Tratar um Comando (-1 para sair) ---
+int handle_command(char* line) {
+    if (strcmp(line, "terminar") == 0) {
+        // A sessão acaba quando chegar a resposta (o loop sai com keep_running a 0)
+        send_request(TERMINATE_REQ, "");
+    }
+    else if (strncmp(line, "agendar ", 8) == 0) {
+        // agendar <hora> <local> <distancia> [destino]
+        send_request(RIDE_REQ, line + 8);
+    }
+    else if (strncmp(line, "cancelar ", 9) == 0) {
+        // cancelar <id>
+        send_request(CANCEL_REQ, line + 9);
     }
-    return NULL;
+    else if (strcmp(line, "consultar") == 0) {
+        // consultar
+        send_request(CONSULT_REQ, "");
+    }
+    else if (strlen(line) > 0) {
+        printf("[CLIENTE] Comandos disponíveis:\n");
+        printf("  agendar <hora> <local> <distancia> [destino]\n");
+        printf("  cancelar <id>\n");
+        printf("  consultar\n");
+        printf("  terminar\n");
+    }
+
+    printf("\r\033[KCMD> ");
+    fflush(stdout);
+    return keep_running ? 0 : -1;  // send_request falhou: controlador morreu
 }
 
 // --- Enviar Pedido ---
 void send_request(RequestType type, char* data) {
-    ClientMessage msg;
-    msg.client_pid = my_pid;
-    msg.type = type;
-    strcpy(msg.client_name, my_name);
-    strcpy(msg.data, data ? data : "");
+    // Payload: nome ('\0' incluído) seguido dos dados
+    char payload[FRAME_MAX_PAYLOAD];
+    size_t name_len = strlen(my_name) + 1;
+    size_t data_len = data ? strlen(data) : 0;
+    if (name_len + data_len > FRAME_MAX_PAYLOAD) {
+        data_len = FRAME_MAX_PAYLOAD - name_len;
+    }
+    memcpy(payload, my_name, name_len);
+    if (data_len > 0) memcpy(payload + name_len, data, data_len);
     
-    if (write(server_fd, &msg, sizeof(ClientMessage)) == -1) {
+    if (frame_write(server_fd, (uint8_t)type, 0, my_pid, payload, name_len + data_len) == -1) {
         perror("[CLIENTE] Erro ao enviar (Server morreu?)");
         keep_running = 0;
     }
 }
 
+// --- Sinal SIGINT: acordar o loop de eventos (só funções async-signal-safe) ---
+void handle_sigint(int signal) {
+    int saved_errno = errno;
+    write(signal_pipe[1], "x", 1);
+    errno = saved_errno;
+}
+
 // --- Limpeza e Saída ---
 void cleanup_and_exit(int signal) {
     if (keep_running) {
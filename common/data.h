@@ -11,11 +11,15 @@
 #include <signal.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
 
 // --- Constantes de Comunicação ---
 #define PIPE_SERVER "/tmp/server_pipe"
 #define PIPE_CLIENT_FMT "/tmp/cli_%d" 
 #define PIPE_VEHICLE_FMT "/tmp/veic_%d"
+#define SHM_TELEMETRY_FMT "/taxi_telemetria_%d"  // PID do controlador (TELEMETRIA_SHM)
 
 #define BUFFER_SIZE 256
 
@@ -53,7 +57,7 @@ typedef enum {
     VEHICLE_AVAILABLE = 1
 } VehicleAvailability;
 
-// --- Estrutura Mensagem (Cliente -> Controlador) ---
+// --- Estrutura Mensagem (Cliente -> Controlador, já descodificada) ---
 typedef struct {
     pid_t client_pid;
     char client_name[50];
@@ -61,13 +65,111 @@ typedef struct {
     char data[BUFFER_SIZE]; 
 } ClientMessage;
 
-// --- Estrutura Resposta (Controlador -> Cliente) ---
+// --- Protocolo: Frames de Tamanho Variável ---
+// Cada mensagem é um cabeçalho fixo seguido de 'length' bytes de payload.
+// Um frame nunca excede PIPE_BUF, por isso cada write() é atómico mesmo
+// com vários escritores no mesmo pipe. Textos maiores são divididos em
+// vários frames com FRAME_F_MORE.
+#define FRAME_MAGIC 0x5846
+#define FRAME_MAX_SIZE PIPE_BUF
+#define FRAME_MAX_PAYLOAD (FRAME_MAX_SIZE - (int)sizeof(FrameHeader))
+
+#define FRAME_F_SUCCESS 0x01  // Resposta: pedido aceite
+#define FRAME_F_MORE    0x02  // Resposta: o texto continua no frame seguinte
+
+typedef enum {
+    // Cliente -> Controlador: opcode = RequestType
+    // Payload: nome do cliente ('\0' incluído) seguido dos dados do pedido
+    OP_RESPONSE = 0x10,       // Controlador/Veículo -> Cliente. Payload: texto
+    // Controlador -> Veículo (pipe de comandos ligado ao stdin do veículo)
+    OP_VEHICLE_ASSIGN = 0x20, // Payload: TripAssignment
+    OP_VEHICLE_CANCEL = 0x21  // Payload: int32_t service_id
+} FrameOpcode;
+
 typedef struct {
-    int success;
-    char message[BUFFER_SIZE];
-} ControllerResponse;
+    uint16_t magic;
+    uint8_t opcode;      // RequestType ou FrameOpcode
+    uint8_t flags;
+    int32_t sender_pid;
+    uint16_t length;     // Bytes de payload a seguir ao cabeçalho
+    uint16_t reserved;
+} FrameHeader;
+
+// Monta cabeçalho + payload em 'out' (>= FRAME_MAX_SIZE). Devolve o tamanho total.
+static inline int frame_encode(char* out, uint8_t opcode, uint8_t flags, pid_t pid,
+                               const void* payload, size_t len) {
+    if (len > FRAME_MAX_PAYLOAD) len = FRAME_MAX_PAYLOAD;
+
+    FrameHeader hdr;
+    hdr.magic = FRAME_MAGIC;
+    hdr.opcode = opcode;
+    hdr.flags = flags;
+    hdr.sender_pid = pid;
+    hdr.length = (uint16_t)len;
+    hdr.reserved = 0;
+
+    memcpy(out, &hdr, sizeof(FrameHeader));
+    if (len > 0) memcpy(out + sizeof(FrameHeader), payload, len);
+    return (int)(sizeof(FrameHeader) + len);
+}
+
+// Envia um frame com um único write()
+static inline ssize_t frame_write(int fd, uint8_t opcode, uint8_t flags, pid_t pid,
+                                  const void* payload, size_t len) {
+    char frame[FRAME_MAX_SIZE];
+    int total = frame_encode(frame, opcode, flags, pid, payload, len);
+    return write(fd, frame, total);
+}
+
+// Lê exatamente n bytes (0 em EOF, -1 em erro)
+static inline ssize_t read_full(int fd, void* buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = read(fd, (char*)buf + done, n - done);
+        if (r == 0) return 0;
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += r;
+    }
+    return (ssize_t)done;
+}
+
+// Escreve exatamente n bytes (-1 em erro)
+static inline ssize_t write_full(int fd, const void* buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t w = write(fd, (const char*)buf + done, n - done);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += w;
+    }
+    return (ssize_t)done;
+}
+
+// Lê um frame completo. Devolve o tamanho do payload, -1 em EOF/erro/frame inválido.
+static inline ssize_t frame_read(int fd, FrameHeader* hdr, void* payload, size_t cap) {
+    ssize_t r = read_full(fd, hdr, sizeof(FrameHeader));
+    if (r <= 0) return -1;
+    if (hdr->magic != FRAME_MAGIC || hdr->length > FRAME_MAX_PAYLOAD || hdr->length > cap) {
+        return -1;
+    }
+    if (hdr->length > 0) {
+        r = read_full(fd, payload, hdr->length);
+        if (r <= 0) return -1;
+    }
+    return hdr->length;
+}
 
 // --- Estruturas de Dados do Sistema ---
+typedef struct {
+    double x;  // km para este (origem: Lisboa)
+    double y;  // km para norte
+} Position;
+
 typedef struct {
     int pid;
     char name[50];
@@ -80,20 +182,99 @@ typedef struct {
     VehicleAvailability available;
     int progress_percent;  // 0-100
     int service_id;  // -1 se não atribuído
-    pid_t process_pid;
+    pid_t process_pid;  // Processo do veículo (vive entre viagens), 0 se não existe
     double total_km;
+    int telemetry_fd;  // Lado de leitura do pipe de telemetria, -1 se fechado
+    int command_fd;    // Lado de escrita do pipe de comandos, -1 se fechado
+    Position position; // Onde ficou o último passageiro (ou a posição inicial)
 } VehicleInfo;
 
+// --- Atribuição de Viagem (Controlador -> Veículo) ---
+typedef struct {
+    int32_t service_id;
+    int32_t client_pid;
+    double distance_km;
+    char origem[100];
+} TripAssignment;
+
+// --- Telemetria (Veículo -> Controlador) ---
+// Registo binário de tamanho fixo, enviado com um único write() (< PIPE_BUF,
+// logo atómico): o controlador lê sempre registos inteiros, sem parsing.
+typedef enum {
+    TELEMETRY_TRIP_STARTED = 1,  // Cliente contactado, viagem iniciada
+    TELEMETRY_PROGRESS,          // percent e km percorridos até agora
+    TELEMETRY_COMPLETED,         // km = distância total
+    TELEMETRY_CANCELLED
+} TelemetryEvent;
+
+typedef struct {
+    int32_t vehicle_id;
+    int32_t service_id;
+    double km;
+    uint8_t event;       // TelemetryEvent
+    uint8_t percent;     // 0-100
+    uint16_t reserved;
+} TelemetryRecord;
+
+// --- Telemetria em Memória Partilhada (opcional) ---
+// Um anel produtor único (veículo) / consumidor único (controlador) por slot
+// de veículo. O veículo marca o anel no bitmap 'dirty' e só faz write() no
+// eventfd quando o bit estava limpo, ou seja, uma vez por lote drenado.
+#define TELEMETRY_RING_SIZE 64  // Registos por anel (potência de 2)
+
+typedef struct {
+    _Atomic uint32_t head;  // Próximo registo a escrever (só o veículo altera)
+    char pad_head[60];      // head e tail em linhas de cache diferentes
+    _Atomic uint32_t tail;  // Próximo registo a ler (só o controlador altera)
+    char pad_tail[60];
+    TelemetryRecord records[TELEMETRY_RING_SIZE];
+} TelemetryRing;
+
+// Segmento: cabeçalho, bitmap de anéis com dados e depois os anéis (alinhados a 64)
+typedef struct {
+    uint32_t num_rings;
+    uint32_t reserved;
+} TelemetryShmHeader;
+
+static inline size_t telemetry_shm_rings_offset(uint32_t num_rings) {
+    size_t offset = sizeof(TelemetryShmHeader) + ((num_rings + 63) / 64) * sizeof(uint64_t);
+    return (offset + 63) & ~(size_t)63;
+}
+
+static inline size_t telemetry_shm_size(uint32_t num_rings) {
+    return telemetry_shm_rings_offset(num_rings) + num_rings * sizeof(TelemetryRing);
+}
+
+static inline _Atomic uint64_t* telemetry_shm_dirty(void* base) {
+    return (_Atomic uint64_t*)((char*)base + sizeof(TelemetryShmHeader));
+}
+
+static inline TelemetryRing* telemetry_shm_ring(void* base, uint32_t ring_idx) {
+    uint32_t num_rings = ((TelemetryShmHeader*)base)->num_rings;
+    return (TelemetryRing*)((char*)base + telemetry_shm_rings_offset(num_rings)) + ring_idx;
+}
+
+// --- Serviço ---
+// Dividido em duas tabelas paralelas com o mesmo handle: ServiceInfo tem só
+// os campos lidos nos varrimentos (agendador, consultas, telemetria) e
+// ServiceDetail o resto. Nomes e locais são handles de textos partilhados.
 typedef struct {
     int id;
-    char client_name[50];
     int client_pid;
     int scheduled_time;  // em segundos
-    char origem[100];
-    char destino[100];
     int vehicle_id;  // -1 se não atribuído
     ServiceStatus status;
     double distance_km;
 } ServiceInfo;
 
+typedef struct {
+    int client_name_id;   // Handles na tabela de textos do controlador
+    int origem_id;
+    int destino_id;       // Texto vazio se o pedido não indicou destino
+    int has_origin_pos;
+    int has_dest_pos;
+    Position origin_pos;  // Válida se has_origin_pos
+    Position dest_pos;    // Válida se has_dest_pos
+} ServiceDetail;
+
 #endif
\ No newline at end of file
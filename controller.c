@@ -1,31 +1,529 @@
 #include "common/data.h"
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <math.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdarg.h>
 
 // --- Constantes Internas ---
-#define MAX_CLIENTS 10
-#define MAX_VEHICLES 10
-#define MAX_SERVICES 50
+#define DEFAULT_VEHICLES 10     // Frota se NVEICULOS não estiver definido
+#define INITIAL_CLIENTS 16      // Capacidade inicial (as tabelas crescem conforme necessário)
+#define INITIAL_SERVICES 64
+#define CLIENT_QUEUE_SIZE 16    // Respostas pendentes por cliente
+#define TELEMETRY_MAX_EVENTS 64 // Eventos tratados por cada epoll_wait
+#define TELEMETRY_BATCH 32      // Registos de telemetria lidos por cada read()
+#define TELEMETRY_WAKE_TAG 0xFFFFFFFFu  // Evento do pipe anónimo (acordar a thread)
+#define TELEMETRY_SHM_TAG 0xFFFFFFFEu   // eventfd dos anéis de telemetria (TELEMETRIA_SHM)
+#define CLIENT_CONN_TAG 0x80000000u     // Evento de escrita num pipe de cliente
+#define VEHICLE_EXEC_FAILED 127         // Estado de saída do filho quando execl falha
+#define SIM_TICK_MS 10          // Resolução da roda de timers (simulação interna)
+#define SIM_WHEEL_SLOTS 512     // Uma volta da roda = 5.12 s; timers mais longos dão várias voltas
+#define SIM_DEFAULT_THREADS 4   // Threads da pool se SIM_THREADS não estiver definido
+#define REQUEST_DEFAULT_THREADS 4   // Workers de pedidos se REQ_THREADS não estiver definido
+#define REQUEST_READ_SIZE 65536     // Bytes lidos do pipe servidor em cada read()
+#define GRID_CELL_KM 10.0       // Lado de cada célula da grelha de veículos livres
+#define GRID_BITS 12
+#define PLACE_MAX_KM 1e6        // Coordenadas "x,y" aceites: |x| e |y| abaixo deste valor
+#define GRID_BUCKETS (1 << GRID_BITS)  // Células distintas (hash das coordenadas da célula)
+#define DISPATCH_BATCH_MAX 64   // Serviços por lote no despacho em lote (DESPACHO_LOTE)
+#define STATE_FILE_MAX 32               // Espaço para "/<ficheiro>" depois de DIR_ESTADO (nomes abaixo)
+#define WAL_FILE "servicos.wal"         // Log de transições (dentro de DIR_ESTADO)
+#define SNAPSHOT_FILE "servicos.snap"   // Último snapshot (substituído com rename)
+#define WAL_MAGIC 0x4C415753u           // "SWAL"
+#define SNAPSHOT_MAGIC 0x50414E53u      // "SNAP"
+#define WAL_SNAPSHOT_BYTES (1 << 20)    // Tamanho do log a partir do qual se grava um snapshot
+#define WAL_PROGRESS_STEP 10            // Pontos percentuais entre registos de progresso de uma viagem
+#define WAL_RETRY_MS 500                // Espera antes de voltar a escrever um lote que falhou
+#define RECOVERY_GRACE_S 300            // Segundos simulados para o dono reclamar uma reserva recuperada
+#define ARCHIVE_FILE "historico.dat"    // Arquivo de viagens terminadas (dentro de DIR_ESTADO)
+#define ARCHIVE_TMP_FMT "/tmp/taxi_historico_%d"  // Sem DIR_ESTADO: só dura enquanto o controlador corre
+#define ARCHIVE_MAGIC 0x56484341u       // "ACHV"
+#define ARCHIVE_INITIAL_RECORDS 1024    // O ficheiro duplica quando enche
+#define HISTORY_LINES 20                // Viagens mostradas pelo comando historico
+#define STATS_SUB_BITS 4                // Histogramas: 16 sub-baldes por potência de 2 (erro <= 6.25%)
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 48               // Valores a partir de 2^48 ns (~78 h) contam no último balde
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+#define METRICS_REQUEST_WAIT_MS 200     // Espera pelo pedido HTTP (sem pedido: envia só as métricas)
+#define METRICS_SEND_TIMEOUT_S 1        // Um leitor parado não prende a thread de métricas
+#define LOG_RING_SIZE 256               // Registos por anel de log (potência de 2; um anel por thread)
+#define LOG_TEXT_MAX 200                // Texto formatado de cada registo (mensagens maiores são cortadas)
+#define LOG_MAX_ARGS 8                  // Argumentos guardados por registo (os seguintes não aparecem)
+#define LOG_STRINGS_MAX 128             // Bytes para as cópias dos %s de um registo
+#define LOG_IDLE_WAIT_MS 1000           // Espera máxima da thread de log sem ser acordada
+#define LOG_ROTATE_KEEP 3               // Ficheiros antigos mantidos na rotação (.1 a .3)
+
+// --- Estruturas Internas ---
+
+// Tabela dinâmica: slots contíguos reutilizados através de uma lista livre.
+// O handle de cada entrada é o índice do slot e não muda enquanto a entrada
+// existir; o array pode mudar de sítio ao crescer, por isso não se guardam
+// ponteiros para entradas depois de um slab_alloc.
+typedef struct {
+    void** items;          // Ponteiro tipado para os elementos (clients, vehicles, ...)
+    size_t item_size;
+    void** detail_items;   // Array paralelo opcional com o mesmo handle (NULL se não existe)
+    size_t detail_size;
+    unsigned char* used;   // 1 se o slot está ocupado
+    int* free_slots;       // Pilha de slots libertados (reutilizados primeiro)
+    int num_free;
+    int capacity;
+    int high_water;        // Slots [0, high_water) já foram usados: limite das iterações
+    int count;             // Slots ocupados
+} Slab;
+
+// Texto partilhado (nomes e locais dos serviços): cada texto distinto é
+// guardado uma vez e libertado quando o último serviço que o usa sai.
+typedef struct {
+    char* text;   // malloc
+    int refs;     // Serviços que referem o texto
+} SharedString;
+
+typedef struct {
+    int pid;    // 0 se a entrada está livre
+    int fd;     // Pipe do cliente, aberto uma vez no login (O_NONBLOCK)
+    char* queue[CLIENT_QUEUE_SIZE];          // Frames à espera que o pipe esvazie (malloc)
+    uint16_t queue_len[CLIENT_QUEUE_SIZE];
+    int head;
+    int count;
+} ClientConnection;
+
+// Índice hash de endereçamento aberto (sondagem linear): chave -> handle de slab.
+// Nos índices por nome a chave não é guardada; compara-se com key_of(handle).
+#define INDEX_EMPTY   -1
+#define INDEX_DELETED -2
+
+typedef struct {
+    int* keys;
+    int* values;       // Handle, INDEX_EMPTY ou INDEX_DELETED
+    int capacity;      // Potência de 2
+    int used;          // Entradas ocupadas + removidas (decide quando refazer)
+} IntIndex;
+
+typedef struct {
+    uint32_t* hashes;
+    int* values;       // Handle, INDEX_EMPTY ou INDEX_DELETED
+    int capacity;      // Potência de 2
+    int used;
+    const char* (*key_of)(int handle);
+} NameIndex;
+
+// Viagem de um veículo simulado dentro do controlador (modo SIMULACAO_INTERNA).
+// Cada passo é um timer na roda; quando vence, uma thread da pool emite os
+// mesmos eventos que o processo veiculo e agenda o passo seguinte.
+typedef struct {
+    int active;            // 1 enquanto a viagem decorre
+    unsigned generation;   // Muda em cada atribuição/cancelamento: timers antigos são ignorados
+    int vehicle_id;
+    int service_id;
+    int client_pid;
+    double distance_km;
+    char origem[100];
+    int percent;           // -1 até o veículo chegar ao cliente
+    int step_ms;           // Duração de cada passo de 10%
+} SimTrip;
+
+typedef struct {
+    int vehicle_idx;
+    unsigned generation;
+    long expires_tick;
+} SimTimer;
+
+typedef struct {
+    SimTimer* timers;
+    int count;
+    int capacity;
+} SimWheelSlot;
+
+// Fila de pedidos de um worker. Cada cliente é sempre tratado pelo mesmo
+// worker (hash do PID), por isso os seus pedidos são processados por ordem.
+typedef struct {
+    ClientMessage* items;  // Fila circular
+    int head;
+    int count;
+    int capacity;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} RequestQueue;
+
+// Cabeçalho de cada resposta no buffer da thread de escrita (seguido do frame)
+typedef struct {
+    int32_t client_pid;
+    uint16_t len;
+    uint64_t queued_ns;  // Instante do send_response (0 nos frames com FRAME_F_MORE)
+    uint64_t wal_lsn;    // Registo do log de que a resposta depende (0: nenhum)
+} ResponseRecord;
+
+// Grelha espacial dos veículos disponíveis. O plano é dividido em células
+// de GRID_CELL_KM e cada célula é mapeada (hash) para um balde, por isso a
+// grelha não tem limites; células diferentes podem partilhar um balde.
+typedef struct {
+    int* vehicles;
+    int count;
+    int capacity;
+} GridBucket;
+
+typedef struct {
+    int bucket;  // -1 se o veículo não está na grelha
+    int slot;    // Posição dentro do balde (remoção O(1))
+} GridRef;
+
+// Locais conhecidos para 'agendar' (coordenadas aproximadas, km a partir de Lisboa)
+typedef struct {
+    const char* name;
+    const char* alt_name;  // Grafia com acentos, NULL se igual
+    Position pos;
+} KnownPlace;
+
+typedef struct {
+    int scheduled_time;
+    int service_id;     // Para detetar entradas obsoletas (serviço cancelado)
+    int service_idx;    // Posição em services[]
+} PendingService;
+
+// Instrumentação (comando stats). Cada thread escreve só no seu StatsShard,
+// sem locks nem instruções atómicas de leitura-modificação-escrita; o
+// comando soma todos os shards. Os histogramas são log-lineares (estilo HDR).
+typedef enum {
+    STAT_REQUEST_LOGIN,       // Tratamento de um pedido, um por RequestType (mesma ordem)
+    STAT_REQUEST_RIDE,
+    STAT_REQUEST_CANCEL,
+    STAT_REQUEST_CONSULT,
+    STAT_REQUEST_TERMINATE,
+    STAT_RESPONSE_DELIVERY,   // Do send_response até ao write no pipe do cliente
+    STAT_CLIENTS_LOCK_WAIT,   // Espera e posse de cada lock de área (ordem de LockArea)
+    STAT_CLIENTS_LOCK_HOLD,
+    STAT_SERVICES_LOCK_WAIT,
+    STAT_SERVICES_LOCK_HOLD,
+    STAT_FLEET_LOCK_WAIT,
+    STAT_FLEET_LOCK_HOLD,
+    STAT_SCHEDULER_TICK,      // Uma passagem do agendador (dispatch_due_services)
+    STAT_DISPATCH_DELAY,      // Tempo simulado entre scheduled_time e a atribuição do veículo
+    STAT_NUM_HISTOGRAMS
+} StatHistogram;
+
+typedef enum {
+    STAT_TELEMETRY_RECORDS,
+    STAT_NUM_COUNTERS
+} StatCounter;
+
+typedef enum {
+    LOCK_CLIENTS,
+    LOCK_SERVICES,
+    LOCK_FLEET,
+    NUM_LOCK_AREAS
+} LockArea;
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[STATS_BUCKETS];
+} StatsHistogram;
+
+typedef struct StatsShard {
+    StatsHistogram histograms[STAT_NUM_HISTOGRAMS];
+    _Atomic uint64_t counters[STAT_NUM_COUNTERS];
+    struct StatsShard* next;
+} StatsShard;
+
+// Métricas (METRICAS_SOCKET): contagens lidas com cada lock de área durante
+// pouco tempo, um de cada vez; o texto é formatado já sem locks.
+typedef struct {
+    int vehicles_available;
+    int vehicles_busy;
+    int vehicles_offline;
+    double total_km;
+    int services_scheduled;
+    int services_in_progress;
+    int clients_connected;
+    uint64_t trips_archived;
+    long long sim_time_ms;
+} MetricsSnapshot;
+
+// Log assíncrono: quem regista guarda o formato e os argumentos em bruto num
+// registo de tamanho fixo no anel da sua thread (produtor único, sem locks); a
+// thread de log drena todos os anéis, ordena por tempo, formata e escreve no
+// terminal ou em LOG_FICHEIRO.
+typedef enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+} LogLevel;
+
+typedef union {
+    int64_t i;             // %d %i %c
+    uint64_t u;            // %u %x %o
+    double f;              // %f %e %g
+    const void* p;         // %p
+    uint32_t str;          // %s: posição da cópia em 'strings'
+} LogArg;
+
+typedef struct {
+    uint64_t time_ns;      // Relógio monotónico (stats_now_ns)
+    const char* fmt;       // Literal do printf (log_write é verificado pelo compilador)
+    uint8_t level;         // LogLevel
+    uint8_t num_args;
+    uint16_t strings_len;
+    LogArg args[LOG_MAX_ARGS];
+    char strings[LOG_STRINGS_MAX];  // Cópias terminadas em '\0' (o chamador pode reutilizar o texto)
+} LogRecord;
+
+typedef struct LogRing {
+    _Atomic uint32_t head;     // Próximo registo a escrever (só a thread dona altera)
+    char pad_head[60];         // head e tail em linhas de cache diferentes
+    _Atomic uint32_t tail;     // Próximo registo a ler (só quem drena altera)
+    char pad_tail[60];
+    _Atomic uint64_t dropped;  // Registos perdidos com o anel cheio
+    uint64_t dropped_reported;  // Só quem drena usa estes dois campos
+    uint32_t drain_head;        // head fotografado na drenagem em curso
+    LogRecord records[LOG_RING_SIZE];
+    struct LogRing* next;
+} LogRing;
+
+// Persistência (DIR_ESTADO): cada transição de um serviço é um registo do log.
+// A recuperação lê o snapshot e aplica os registos com LSN posterior.
+typedef enum {
+    WAL_SERVICE_BOOKED = 1,   // Payload: ServiceRecord
+    WAL_SERVICE_DISPATCHED,   // Payload: WalServiceEvent (value = ID do veículo)
+    WAL_SERVICE_PROGRESS,     // Payload: WalServiceEvent (value = percentagem; um por WAL_PROGRESS_STEP)
+    WAL_SERVICE_COMPLETED,    // Payload: WalServiceEvent
+    WAL_SERVICE_CANCELLED     // Payload: WalServiceEvent
+} WalRecordType;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;     // FNV-1a de lsn até ao fim do payload (deteta registos cortados)
+    uint64_t lsn;          // Número de sequência, crescente entre arranques
+    int64_t sim_time_ms;   // Relógio simulado quando o registo foi criado
+    uint16_t type;         // WalRecordType
+    uint16_t length;       // Bytes de payload a seguir ao cabeçalho
+    uint32_t reserved;
+} WalHeader;
+
+typedef struct {
+    int32_t service_id;
+    int32_t value;
+} WalServiceEvent;
+
+// Serviço em disco (formato próprio: não depende da disposição de ServiceInfo)
+typedef struct {
+    int32_t id;
+    int32_t client_pid;
+    int32_t scheduled_time;
+    int32_t vehicle_id;
+    int32_t status;
+    int32_t progress_percent;  // Viagem em curso: último progresso conhecido
+    double distance_km;
+    char client_name[50];
+    char origem[100];
+    char destino[100];
+} ServiceRecord;
+
+// Arquivo: cabeçalho seguido de ServiceRecord de serviços terminados, por ordem
+// de fim. O ficheiro está mapeado em memória; só se acrescenta no fim.
+typedef struct {
+    uint32_t magic;
+    uint32_t record_size;  // sizeof(ServiceRecord): recusa ficheiros de outro formato
+    uint64_t count;        // Registos válidos (aumenta depois de o registo estar escrito)
+    char pad[48];          // Registos alinhados a 64 bytes
+} ArchiveHeader;
+
+// Snapshot: cabeçalho seguido de 'count' ServiceRecord (só serviços por terminar)
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;     // FNV-1a de lsn até ao fim do ficheiro
+    uint64_t lsn;          // Os registos do log com LSN inferior já estão incluídos
+    int64_t sim_time_ms;
+    int32_t next_service_id;
+    int32_t count;
+} SnapshotHeader;
 
 // --- Variáveis Globais ----
-ClientInfo clients[MAX_CLIENTS];
-VehicleInfo vehicles[MAX_VEHICLES];
-ServiceInfo services[MAX_SERVICES];
-int vehicle_telemetry_fds[MAX_VEHICLES];
+ClientInfo* clients = NULL;
+ClientConnection* client_conns = NULL;
+VehicleInfo* vehicles = NULL;
+ServiceInfo* services = NULL;
+ServiceDetail* service_details = NULL;  // Paralelo a services (mesmo handle)
+SharedString* strings = NULL;
+Slab client_table;
+Slab conn_table;
+Slab vehicle_table;
+Slab service_table;
+Slab string_table;
+IntIndex client_by_pid;
+NameIndex client_by_name;
+IntIndex conn_by_pid;
+IntIndex service_by_id;
+NameIndex string_by_text;
+PendingService* pending_heap = NULL;  // Min-heap de serviços agendados por scheduled_time
+int pending_capacity = 0;
+int num_pending = 0;
+int services_scheduled = 0;           // Contagens por estado, mantidas por set_service_status
+int services_in_progress = 0;
+GridBucket vehicle_grid[GRID_BUCKETS]; // Veículos disponíveis por célula
+GridRef* grid_refs = NULL;            // Indexado pelo handle do veículo
+int* launch_retry = NULL;             // Veículos a devolver à grelha no fim do despacho (fleet_lock)
+int num_launch_retry = 0;
+int launch_retry_capacity = 0;
+int grid_refs_capacity = 0;
+int num_free_vehicles = 0;
+const KnownPlace known_places[] = {
+    { "lisboa",    NULL,        {   0,    0 } },  // Base: pedidos sem coordenadas
+    { "porto",     NULL,        {  46,  270 } },
+    { "coimbra",   NULL,        {  62,  165 } },
+    { "braga",     NULL,        {  63,  314 } },
+    { "faro",      NULL,        { 105, -189 } },
+    { "aveiro",    NULL,        {  43,  213 } },
+    { "setubal",   "setúbal",   {  22,  -22 } },
+    { "evora",     "évora",     { 107,  -17 } },
+    { "leiria",    NULL,        {  29,  113 } },
+    { "viseu",     NULL,        { 107,  215 } },
+    { "sintra",    NULL,        { -21,    9 } },
+    { "cascais",   NULL,        { -24,   -2 } },
+    { "guimaraes", "guimarães", {  74,  302 } },
+    { "braganca",  "bragança",  { 207,  343 } },
+    { "beja",      NULL,        { 111,  -78 } },
+    { "santarem",  "santarém",  {  40,   58 } },
+};
+const int num_known_places = sizeof(known_places) / sizeof(known_places[0]);
 int telemetry_pipe_read = -1;
 int telemetry_pipe_write = -1;
-int num_clients = 0;
-int num_vehicles = 0;
-int num_services = 0;
+int telemetry_epoll_fd = -1;
+void* telemetry_shm = NULL;           // TELEMETRIA_SHM: anéis dos veículos (NULL se usa FIFOs)
+size_t telemetry_shm_bytes = 0;
+char telemetry_shm_name[64];
+int telemetry_event_fd = -1;          // Acordado pelos veículos quando marcam um anel
 int next_service_id = 1;
-int simulated_time = 0; // em segundos
+struct timespec sim_clock_start;      // Instante (monotónico) correspondente a 00:00:00 simulado
+double time_speed = 1.0;              // SIM_SPEED: segundos simulados por segundo real
+atomic_int next_due_time = INT_MAX;   // scheduled_time do topo do heap, INT_MAX se vazio
+pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t clock_cond;            // CLOCK_MONOTONIC; sinalizado quando next_due_time muda
 int keep_running = 1;
-pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER; 
+pthread_mutex_t shutdown_mutex = PTHREAD_MUTEX_INITIALIZER;  // Um só encerramento (nunca libertado)
+int reap_pending = 0;   // SIGCHLD recebido: recolher veículos no fim do lote de eventos
+int internal_simulation = 0;          // SIMULACAO_INTERNA: veículos são tarefas, não processos
+int batch_dispatch = 0;               // DESPACHO_LOTE: atribuição ótima dos serviços vencidos
+SimTrip* sim_trips = NULL;            // Indexado pelo handle do veículo
+int sim_num_trips = 0;
+SimWheelSlot sim_wheel[SIM_WHEEL_SLOTS];
+int sim_num_timers = 0;
+long sim_tick = 0;                    // Último tick processado pela roda
+SimTimer* sim_ready = NULL;           // Fila circular de timers vencidos (consumida pela pool)
+int sim_ready_head = 0;
+int sim_ready_count = 0;
+int sim_ready_capacity = 0;
+struct timespec sim_epoch;
+pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;  // Pode ser pedido com fleet_lock, nunca o contrário
+pthread_cond_t sim_wheel_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t sim_ready_cond = PTHREAD_COND_INITIALIZER;
+int* dead_clients = NULL;             // PIDs com o pipe sem leitor, removidos pela thread de telemetria
+int num_dead_clients = 0;
+int dead_clients_capacity = 0;
+
+// Locks por área. Ordem de aquisição: clients -> services -> fleet -> conn.
+// O estado do cliente (ClientStatus) pode ser alterado só com clients_lock
+// em leitura, através de set_client_status.
+pthread_rwlock_t clients_lock = PTHREAD_RWLOCK_INITIALIZER;   // clients, client_by_pid, client_by_name
+pthread_rwlock_t services_lock = PTHREAD_RWLOCK_INITIALIZER;  // services, service_by_id, pending_heap, strings
+pthread_rwlock_t fleet_lock = PTHREAD_RWLOCK_INITIALIZER;     // vehicles, vehicle_grid
+pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;       // client_conns, conn_by_pid, dead_clients
+pthread_mutex_t scheduler_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scheduler_cond = PTHREAD_COND_INITIALIZER;
+int scheduler_signalled = 0;
+RequestQueue* request_queues = NULL;  // Uma por worker de pedidos
+int num_request_workers = 0;
+char* outbox = NULL;                  // Respostas codificadas à espera da thread de escrita
+size_t outbox_size = 0;
+size_t outbox_capacity = 0;
+char* outbox_spare = NULL;            // Segundo buffer (trocado com outbox em cada escrita)
+size_t outbox_spare_capacity = 0;
+pthread_mutex_t outbox_mutex = PTHREAD_MUTEX_INITIALIZER;  // Pode ser pedido com qualquer outro lock
+pthread_cond_t outbox_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;  // Uma escrita de cada vez (mantém a ordem)
+int wal_fd = -1;                      // DIR_ESTADO: log de transições (-1 se a persistência está desligada)
+char state_dir[PATH_MAX - STATE_FILE_MAX];  // Cabe sempre "<dir>/<ficheiro>" num PATH_MAX
+char* wal_buffer = NULL;              // Registos à espera da thread do log
+size_t wal_buffer_size = 0;
+size_t wal_buffer_capacity = 0;
+char* wal_spare = NULL;               // Segundo buffer (trocado com wal_buffer em cada escrita)
+size_t wal_spare_capacity = 0;
+uint64_t wal_next_lsn = 1;
+uint64_t wal_durable_lsn = 0;         // Registos até aqui estão em disco (log ou snapshot)
+uint64_t wal_failed_batches = 0;      // Lotes cuja escrita falhou (acorda quem espera em wal_sync)
+off_t wal_file_size = 0;
+int wal_closed = 0;                   // Encerramento: as transições seguintes já não são registadas
+void* archive_map = NULL;             // Arquivo de viagens terminadas (ArchiveHeader + registos)
+size_t archive_capacity = 0;          // Registos que cabem no ficheiro mapeado
+uint64_t archive_synced_count = 0;    // Registos já em disco (só a thread do log os sincroniza)
+int archive_fd = -1;
+char archive_path[PATH_MAX];
+pthread_rwlock_t archive_lock = PTHREAD_RWLOCK_INITIALIZER;  // Pedido depois de qualquer outro lock
+StatsShard* stats_shards = NULL;      // Um por thread que já registou medidas
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;  // Cabeça da lista de shards
+_Thread_local StatsShard* stats_shard = NULL;
+_Thread_local int lock_depth[NUM_LOCK_AREAS];           // Locks de área detidos por esta thread
+_Thread_local uint64_t lock_acquired_ns[NUM_LOCK_AREAS];
+_Thread_local uint64_t wal_last_lsn = 0;  // Último registo do log acrescentado por esta thread
+uint64_t stats_start_ns = 0;
+uint64_t stats_last_ns = 0;           // Último comando stats (só a thread de admin usa)
+uint64_t stats_last_telemetry = 0;
+int metrics_fd = -1;                  // METRICAS_SOCKET: socket Unix à escuta (-1 se desligado)
+char metrics_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+LogRing* log_rings = NULL;            // Um por thread que já registou mensagens
+pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;  // Cabeça da lista de anéis
+_Thread_local LogRing* log_ring = NULL;
+LogLevel log_level = LOG_INFO;        // LOG_NIVEL: mensagens abaixo deste nível não são registadas
+FILE* log_file = NULL;                // LOG_FICHEIRO (NULL: terminal)
+char log_path[PATH_MAX];
+long log_file_bytes = 0;
+long log_rotate_bytes = 0;            // LOG_ROTACAO_KB (0: sem rotação)
+int64_t log_clock_offset_ns = 0;      // Relógio de parede - monotónico (datas no ficheiro)
+pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;  // Uma drenagem de cada vez
+pthread_mutex_t log_wake_mutex = PTHREAD_MUTEX_INITIALIZER;   // Pedido sem outros locks do log
+pthread_cond_t log_wake_cond;         // CLOCK_MONOTONIC; um anel passou de vazio a não vazio
+LogRecord** log_batch = NULL;         // Registos de uma drenagem (só com log_drain_mutex)
+size_t log_batch_capacity = 0;
+int* recovered_progress = NULL;       // Recuperação: progresso das viagens em curso, por handle
+int recovered_progress_capacity = 0;
+pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;         // Buffer e LSNs; pode ser pedido com qualquer lock
+pthread_cond_t wal_cond = PTHREAD_COND_INITIALIZER;            // Há registos para escrever
+pthread_cond_t wal_durable_cond = PTHREAD_COND_INITIALIZER;    // wal_durable_lsn avançou
+pthread_mutex_t wal_writer_mutex = PTHREAD_MUTEX_INITIALIZER;  // Escritas do ficheiro; pedido antes dos locks de dados
 
 // --- Protótipos ---
 void* client_listener_thread(void* arg);
+void request_pipeline_init();
+void decode_client_request(const FrameHeader* hdr, const char* payload, ClientMessage* msg);
+void request_queue_push(RequestQueue* queue, const ClientMessage* msg);
+void* request_worker_thread(void* arg);
+void handle_client_request(ClientMessage* msg);
+void* response_writer_thread(void* arg);
+void write_responses();
 void* time_simulator_thread(void* arg);
+long long sim_time_now_ms();
+int sim_time_now();
+void set_next_due_time(int due);
 void* scheduler_thread(void* arg);
 void* vehicle_telemetry_thread(void* arg);
+void dispatch_due_services();
+int dispatch_batch(int now);
+void assign_vehicle(int service_idx, int vehicle_idx);
+void defer_vehicle_release(int vehicle_idx);
+Position service_origin(int service_idx);
+int hungarian(int rows, int cols, const double* cost, int* assignment);
+int compare_ints(const void* a, const void* b);
+void wake_scheduler_if_due();
 void process_admin_commands();
 void handle_login(ClientMessage msg);
 void handle_client_exit(ClientMessage msg);
@@ -33,25 +531,179 @@ void handle_ride_request(ClientMessage msg);
 void handle_cancel_request(ClientMessage msg);
 void handle_consult_request(ClientMessage msg);
 void send_response(int client_pid, int success, char* text);
+int open_client_connection(int client_pid);
+ClientConnection* find_client_connection(int client_pid);
+void close_client_connection(ClientConnection* conn);
+int flush_client_connection(ClientConnection* conn);
+int send_frame_to_client(ClientConnection* conn, const char* frame, int len);
+int remove_client(int client_idx);
+void handle_dead_client(int client_pid);
+void mark_client_dead(int client_pid);
+void reap_dead_clients();
+void set_client_status(int client_idx, ClientStatus status);
+void set_service_status(int service_idx, ServiceStatus status);
+void count_service_status(ServiceStatus status, int delta);
 void broadcast_shutdown();
 void cleanup_and_exit(int signal);
+void* signal_thread(void* arg);
 void init_vehicles();
+int add_vehicle();
+void slab_init(Slab* slab, void** items, size_t item_size, int capacity);
+void slab_attach(Slab* slab, void** items, size_t item_size);
+int slab_grow(Slab* slab);
+int slab_alloc(Slab* slab);
+void slab_free(Slab* slab, int handle);
+int find_client(int client_pid);
+int find_service(int service_id);
+int find_vehicle(int vehicle_id);
+uint32_t hash_int(int key);
+uint32_t hash_string(const char* key);
+const char* client_name_of(int handle);
+void int_index_init(IntIndex* index, int capacity);
+int int_index_get(IntIndex* index, int key);
+void int_index_put(IntIndex* index, int key, int handle);
+void int_index_remove(IntIndex* index, int key);
+void name_index_init(NameIndex* index, int capacity, const char* (*key_of)(int handle));
+int name_index_get(NameIndex* index, const char* key);
+void name_index_put(NameIndex* index, const char* key, int handle);
+void name_index_remove(NameIndex* index, const char* key);
+int string_intern(const char* text);
+void string_release(int handle);
+const char* string_of(int handle);
+void set_service_detail(int service_idx, const char* client_name, const char* origem, const char* destino);
 void launch_vehicle(int service_index);
-void process_vehicle_telemetry(char* line, int vehicle_id);
-int find_available_vehicle();
+int spawn_vehicle_worker(int vehicle_idx);
+int send_vehicle_command(int vehicle_idx, uint8_t opcode, const void* payload, size_t len);
+void reap_vehicle_workers();
+void handle_sigchld(int signal);
+void finish_service(int service_idx, int completed);
+void sim_init();
+void* sim_wheel_thread(void* arg);
+void* sim_worker_thread(void* arg);
+long sim_now_tick();
+void sim_schedule(int vehicle_idx, int delay_ms);
+void sim_ready_push(SimTimer timer);
+void sim_step(int vehicle_idx, unsigned generation);
+int sim_handle_command(int vehicle_idx, uint8_t opcode, const void* payload, size_t len);
+void reset_vehicle(int vehicle_idx);
+void process_vehicle_telemetry(const TelemetryRecord* rec);
+int register_vehicle_telemetry(int vehicle_idx);
+void unregister_vehicle_telemetry(int vehicle_idx);
+void telemetry_shm_init(int num_rings);
+void drain_telemetry_rings();
+int take_available_vehicle(Position near);
+int grid_nearest(Position near, int k, int* out, double* out_dist);
+void release_vehicle(int vehicle_idx);
+int locate_place(const char* text, Position* pos);
+double distance_km(Position a, Position b);
+int grid_coord(double km);
+int grid_bucket_of(int cell_x, int cell_y);
+int grid_insert(int vehicle_idx);
+void grid_remove(int vehicle_idx);
+void grid_scan_bucket(int bucket, Position near, int k, int* found, int* best, double* best_dist);
+int pending_before(const PendingService* a, const PendingService* b);
+void pending_push(int service_idx);
+void pending_push_at(int service_idx, int due_time);
+void cancel_unclaimed_service(int service_idx);
+void pending_pop();
 void cmd_listar();
 void cmd_utiliz();
 void cmd_frota();
 void cmd_cancelar(int service_id);
+int admin_cancel_service(int service_idx);
 void cmd_km();
 void cmd_hora();
+void wal_init();
+void wal_recover();
+int wal_load_snapshot(uint64_t* lsn, long long* time_ms);
+void wal_apply(const WalHeader* hdr, const char* payload);
+void set_recovered_progress(int service_idx, int percent);
+void* wal_thread(void* arg);
+void wal_append(uint16_t type, const void* payload, size_t len);
+void wal_log_booking(int service_idx);
+void wal_log_event(uint16_t type, int service_id, int value);
+off_t wal_flush();
+int wal_write_batch(const char* batch, size_t size);
+int wal_sync(uint64_t lsn);
+void wal_requeue(char** batch, size_t* batch_capacity, size_t batch_size);
+int wal_snapshot();
+void wal_close();
+uint32_t wal_checksum(const WalHeader* hdr, const void* payload, size_t len);
+uint32_t fnv1a_update(uint32_t h, const void* data, size_t len);
+void state_path(char* out, size_t size, const char* file);
+void service_to_record(int service_idx, int progress_percent, ServiceRecord* rec);
+int service_from_record(const ServiceRecord* rec);
+int rebind_client_services(const char* client_name, int client_pid);
+int service_progress(int service_idx);
+void retire_service(int service_idx, int progress_percent);
+void drop_service(int service_idx);
+void archive_init();
+void archive_service(int service_idx, int progress_percent);
+int archive_sync();
+int archive_grow();
+ServiceRecord* archive_records();
+void cmd_historico(const char* client_name);
+uint64_t stats_now_ns();
+StatsShard* stats_local();
+void stats_add(_Atomic uint64_t* cell, uint64_t n);
+void stats_record(StatHistogram stat, uint64_t value);
+void stats_count(StatCounter counter, uint64_t n);
+int stats_bucket(uint64_t value);
+uint64_t stats_bucket_value(int bucket);
+uint64_t stats_percentile(const uint64_t* buckets, uint64_t count, uint64_t max, double p);
+StatsShard* stats_first_shard();
+void stats_collect(StatHistogram stat, uint64_t* buckets, uint64_t* count, uint64_t* sum, uint64_t* max);
+uint64_t stats_counter_total(StatCounter counter);
+int lock_area_of(pthread_rwlock_t* lock);
+void timed_rdlock(pthread_rwlock_t* lock);
+void timed_wrlock(pthread_rwlock_t* lock);
+void timed_unlock(pthread_rwlock_t* lock);
+void lock_acquired(int area, uint64_t wait_start);
+void format_duration(char* out, size_t size, uint64_t ns);
+void cmd_stats();
+void metrics_init();
+void* metrics_thread(void* arg);
+void metrics_serve(int fd);
+void metrics_snapshot(MetricsSnapshot* snap);
+void metrics_render(FILE* out);
+void log_init();
+void log_write(LogLevel level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+LogRing* log_local();
+void log_pack(LogRecord* rec, const char* fmt, va_list args);
+size_t log_format(const LogRecord* rec, char* out, size_t size);
+void* log_thread(void* arg);
+int log_has_records();
+void log_drain();
+int log_record_cmp(const void* a, const void* b);
+int log_emit(const LogRecord* rec);
+void log_rotate();
 
 // --- Main ---
 int main(int argc, char *argv[]) {
     printf("[CONTROLADOR] A iniciar sistema...\n");
 
-    // Tratamento de Sinais (CTRL+C)
-    signal(SIGINT, cleanup_and_exit);
+    // Escritas para clientes que morreram devolvem EPIPE em vez de terminar o processo
+    signal(SIGPIPE, SIG_IGN);
+    // Veículos que terminam são recolhidos (e relançados) pela thread de telemetria
+    signal(SIGCHLD, handle_sigchld);
+
+    // Só a thread de telemetria recebe SIGCHLD (não interrompe o sleep das outras).
+    // SIGINT (CTRL+C) fica bloqueado em todas: a thread de sinais recebe-o com sigwait
+    // e encerra fora de contexto de handler (o encerramento escreve logs e respostas)
+    sigset_t chld_set;
+    sigemptyset(&chld_set);
+    sigaddset(&chld_set, SIGCHLD);
+    sigaddset(&chld_set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &chld_set, NULL);
+
+    pthread_t t_signal;
+    if (pthread_create(&t_signal, NULL, signal_thread, NULL) != 0) {
+        perror("[CONTROLADOR] Erro thread de sinais");
+        exit(1);
+    }
+
+    // Log assíncrono (antes de qualquer thread que registe mensagens)
+    log_init();
 
     // Criar pipe anónimo para telemetria
     int pipe_fds[2];
@@ -62,17 +714,92 @@ int main(int argc, char *argv[]) {
     telemetry_pipe_read = pipe_fds[0];
     telemetry_pipe_write = pipe_fds[1];
     fcntl(telemetry_pipe_read, F_SETFL, O_NONBLOCK);
+    fcntl(telemetry_pipe_write, F_SETFL, O_NONBLOCK);  // Escrito pelo handler de SIGCHLD
+    fcntl(telemetry_pipe_read, F_SETFD, FD_CLOEXEC);
+    fcntl(telemetry_pipe_write, F_SETFD, FD_CLOEXEC);
+
+    // Criar epoll para a telemetria (os pipes dos veículos são registados em spawn_vehicle_worker)
+    telemetry_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (telemetry_epoll_fd == -1) {
+        perror("[CONTROLADOR] Erro ao criar epoll de telemetria");
+        exit(1);
+    }
+    struct epoll_event wake_ev;
+    wake_ev.events = EPOLLIN;
+    wake_ev.data.u32 = TELEMETRY_WAKE_TAG;
+    if (epoll_ctl(telemetry_epoll_fd, EPOLL_CTL_ADD, telemetry_pipe_read, &wake_ev) == -1) {
+        perror("[CONTROLADOR] Erro ao registar pipe de telemetria");
+        exit(1);
+    }
 
     // Validar ambiente
-    if(getenv("NVEICULOS") == NULL) {
-        printf("[CONTROLADOR] AVISO: NVEICULOS não definido. A usar padrão (%d).\n", MAX_VEHICLES);
+    if(getenv("NVEICULOS") == NULL || atoi(getenv("NVEICULOS")) <= 0) {
+        printf("[CONTROLADOR] AVISO: NVEICULOS não definido. A usar padrão (%d).\n", DEFAULT_VEHICLES);
         char nveiculos_str[12];
-        sprintf(nveiculos_str, "%d", MAX_VEHICLES);
+        sprintf(nveiculos_str, "%d", DEFAULT_VEHICLES);
         setenv("NVEICULOS", nveiculos_str, 1);
     }
 
+    // Relógio simulado acelerado (ex: SIM_SPEED=60 -> um minuto por segundo).
+    // Normalizado no ambiente para os veículos usarem o mesmo valor.
+    if (getenv("SIM_SPEED") != NULL) {
+        if (atof(getenv("SIM_SPEED")) > 0) {
+            time_speed = atof(getenv("SIM_SPEED"));
+            printf("[CONTROLADOR] Relógio simulado a %gx.\n", time_speed);
+        } else {
+            printf("[CONTROLADOR] AVISO: SIM_SPEED inválido. A usar tempo real.\n");
+        }
+    }
+    char speed_str[32];
+    snprintf(speed_str, sizeof(speed_str), "%g", time_speed);
+    setenv("SIM_SPEED", speed_str, 1);
+
+    pthread_condattr_t clock_attr;
+    pthread_condattr_init(&clock_attr);
+    pthread_condattr_setclock(&clock_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&clock_cond, &clock_attr);
+    pthread_condattr_destroy(&clock_attr);
+    clock_gettime(CLOCK_MONOTONIC, &sim_clock_start);
+    stats_start_ns = stats_last_ns = stats_now_ns();
+
+    // Despacho em lote: os serviços que vencem juntos são atribuídos de uma vez
+    if (getenv("DESPACHO_LOTE") != NULL && atoi(getenv("DESPACHO_LOTE")) > 0) {
+        batch_dispatch = 1;
+        printf("[CONTROLADOR] Despacho em lote (atribuição de custo mínimo).\n");
+    }
+
+    // Modo de teste de carga: os veículos correm como tarefas dentro do controlador
+    if (getenv("SIMULACAO_INTERNA") != NULL && atoi(getenv("SIMULACAO_INTERNA")) > 0) {
+        internal_simulation = 1;
+    }
+
+    // Telemetria por memória partilhada em vez de um FIFO por veículo
+    if (!internal_simulation && getenv("TELEMETRIA_SHM") != NULL && atoi(getenv("TELEMETRIA_SHM")) > 0) {
+        telemetry_shm_init(atoi(getenv("NVEICULOS")));
+    }
+
+    // Tabelas dinâmicas (crescem em runtime)
+    slab_init(&client_table, (void**)&clients, sizeof(ClientInfo), INITIAL_CLIENTS);
+    slab_init(&conn_table, (void**)&client_conns, sizeof(ClientConnection), INITIAL_CLIENTS);
+    slab_init(&service_table, (void**)&services, sizeof(ServiceInfo), INITIAL_SERVICES);
+    slab_attach(&service_table, (void**)&service_details, sizeof(ServiceDetail));
+    slab_init(&string_table, (void**)&strings, sizeof(SharedString), INITIAL_SERVICES);
+    slab_init(&vehicle_table, (void**)&vehicles, sizeof(VehicleInfo), atoi(getenv("NVEICULOS")));
+    int_index_init(&client_by_pid, INITIAL_CLIENTS * 2);
+    name_index_init(&client_by_name, INITIAL_CLIENTS * 2, client_name_of);
+    int_index_init(&conn_by_pid, INITIAL_CLIENTS * 2);
+    int_index_init(&service_by_id, INITIAL_SERVICES * 2);
+    name_index_init(&string_by_text, INITIAL_SERVICES * 2, string_of);
+
+    // Reservas de um arranque anterior (DIR_ESTADO) e thread do log
+    wal_init();
+    archive_init();
+
     // Inicializar veículos
     init_vehicles();
+    if (internal_simulation) {
+        sim_init();
+    }
 
     // Criar Pipe Principal
     if (mkfifo(PIPE_SERVER, 0666) == -1 && errno != EEXIST) {
@@ -80,6 +807,9 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    // Workers de pedidos e thread de escrita (antes do leitor)
+    request_pipeline_init();
+
     // Thread Clientes
     pthread_t t_client, t_time, t_scheduler;
     if (pthread_create(&t_client, NULL, client_listener_thread, NULL) != 0) {
@@ -106,6 +836,9 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    // Endpoint de métricas (opcional)
+    metrics_init();
+
     process_admin_commands();
 
     cleanup_and_exit(0);
@@ -124,133 +857,391 @@ const char* get_request_type_name(RequestType type) {
     }
 }
 
+// --- Pipeline de Pedidos ---
+// leitor (client_listener_thread) -> workers (um por fila) -> escrita (response_writer_thread)
+void request_pipeline_init() {
+    num_request_workers = REQUEST_DEFAULT_THREADS;
+    if (getenv("REQ_THREADS") != NULL && atoi(getenv("REQ_THREADS")) > 0) {
+        num_request_workers = atoi(getenv("REQ_THREADS"));
+    }
+
+    request_queues = calloc(num_request_workers, sizeof(RequestQueue));
+    if (request_queues == NULL) {
+        perror("[CONTROLADOR] Erro ao alocar filas de pedidos");
+        exit(1);
+    }
+
+    pthread_t t_worker;
+    for (int i = 0; i < num_request_workers; i++) {
+        pthread_mutex_init(&request_queues[i].mutex, NULL);
+        pthread_cond_init(&request_queues[i].cond, NULL);
+        if (pthread_create(&t_worker, NULL, request_worker_thread, &request_queues[i]) != 0) {
+            perror("[CONTROLADOR] Erro thread de pedidos");
+            exit(1);
+        }
+    }
+
+    if (pthread_create(&t_worker, NULL, response_writer_thread, NULL) != 0) {
+        perror("[CONTROLADOR] Erro thread de respostas");
+        exit(1);
+    }
+}
+
 // --- Thread de Leitura ---
 void* client_listener_thread(void* arg) {
     int fd = open(PIPE_SERVER, O_RDWR); 
     if (fd == -1) return NULL;
 
-    ClientMessage msg;
+    // Cada read() traz todos os frames que estiverem no pipe (cada um é atómico,
+    // mas o último pode ficar a meio: guarda-se para o read seguinte)
+    char* buffer = malloc(REQUEST_READ_SIZE);
+    if (buffer == NULL) {
+        close(fd);
+        return NULL;
+    }
+    size_t buffered = 0;
+
     while (keep_running) {
-        if (read(fd, &msg, sizeof(ClientMessage)) > 0) {
-            //!DEBUG
-            //printf("\r\033[K[CONTROLADOR] Recebido pedido [%s] de %s (PID %d)\n", 
-            //    get_request_type_name(msg.type), msg.client_name, msg.client_pid);
-            //printf("CMD> "); fflush(stdout);
-            
-            // Processamento seguro com Mutex
-            pthread_mutex_lock(&data_mutex);
-            
-            switch (msg.type) {
-                case LOGIN_REQ:
-                    handle_login(msg);
-                    break;
-                case RIDE_REQ:
-                    handle_ride_request(msg);
-                    break;
-                case CANCEL_REQ:
-                    handle_cancel_request(msg);
-                    break;
-                case CONSULT_REQ:
-                    handle_consult_request(msg);
-                    break;
-                case TERMINATE_REQ:
-                    handle_client_exit(msg);
-                    break;
-                default:
-                    break;
+        ssize_t n = read(fd, buffer + buffered, REQUEST_READ_SIZE - buffered);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buffered += n;
+
+        size_t offset = 0;
+        while (buffered - offset >= sizeof(FrameHeader)) {
+            FrameHeader hdr;
+            memcpy(&hdr, buffer + offset, sizeof(FrameHeader));
+            if (hdr.magic != FRAME_MAGIC || hdr.length > FRAME_MAX_PAYLOAD) {
+                // Lixo no pipe: descartar o que foi lido e voltar a sincronizar
+                offset = buffered;
+                break;
             }
-            
-            pthread_mutex_unlock(&data_mutex);
+            if (buffered - offset < sizeof(FrameHeader) + hdr.length) break;
+
+            ClientMessage msg;
+            decode_client_request(&hdr, buffer + offset + sizeof(FrameHeader), &msg);
+            offset += sizeof(FrameHeader) + hdr.length;
+
+            log_write(LOG_DEBUG, "Recebido pedido [%s] de %s (PID %d)",
+                      get_request_type_name(msg.type), msg.client_name, msg.client_pid);
+
+            int worker = (hash_int(msg.client_pid) >> 16) % num_request_workers;
+            request_queue_push(&request_queues[worker], &msg);
         }
+
+        memmove(buffer, buffer + offset, buffered - offset);
+        buffered -= offset;
     }
+    free(buffer);
     close(fd);
     return NULL;
 }
 
+// --- Descodificar Pedido: nome ('\0' incluído) seguido dos dados do pedido ---
+void decode_client_request(const FrameHeader* hdr, const char* payload, ClientMessage* msg) {
+    size_t len = hdr->length;
+    size_t name_len = strnlen(payload, len);
+    msg->client_pid = hdr->sender_pid;
+    msg->type = (RequestType)hdr->opcode;
+
+    size_t copy = name_len < sizeof(msg->client_name) - 1 ? name_len : sizeof(msg->client_name) - 1;
+    memcpy(msg->client_name, payload, copy);
+    msg->client_name[copy] = '\0';
+
+    if (name_len < len) {
+        size_t data_len = strnlen(payload + name_len + 1, len - name_len - 1);
+        copy = data_len < sizeof(msg->data) - 1 ? data_len : sizeof(msg->data) - 1;
+        memcpy(msg->data, payload + name_len + 1, copy);
+        msg->data[copy] = '\0';
+    } else {
+        msg->data[0] = '\0';
+    }
+}
+
+// --- Pôr Pedido na Fila de um Worker ---
+void request_queue_push(RequestQueue* queue, const ClientMessage* msg) {
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->count == queue->capacity) {
+        int new_capacity = queue->capacity > 0 ? queue->capacity * 2 : 64;
+        ClientMessage* grown = malloc(new_capacity * sizeof(ClientMessage));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&queue->mutex);
+            log_write(LOG_WARN, "Fila de pedidos cheia, pedido de %d descartado", msg->client_pid);
+            return;
+        }
+        // Desenrolar a fila circular para o início do novo array
+        for (int i = 0; i < queue->count; i++) {
+            grown[i] = queue->items[(queue->head + i) % queue->capacity];
+        }
+        free(queue->items);
+        queue->items = grown;
+        queue->head = 0;
+        queue->capacity = new_capacity;
+    }
+
+    queue->items[(queue->head + queue->count) % queue->capacity] = *msg;
+    queue->count++;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// --- Thread Worker de Pedidos ---
+void* request_worker_thread(void* arg) {
+    RequestQueue* queue = arg;
+    ClientMessage msg;
+
+    pthread_mutex_lock(&queue->mutex);
+    while (keep_running) {
+        if (queue->count == 0) {
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+            continue;
+        }
+
+        msg = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+
+        pthread_mutex_unlock(&queue->mutex);
+        handle_client_request(&msg);
+        pthread_mutex_lock(&queue->mutex);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return NULL;
+}
+
+// --- Tratar Pedido (cada pedido bloqueia apenas a tabela que usa) ---
+void handle_client_request(ClientMessage* msg) {
+    uint64_t start = stats_now_ns();
+    wal_last_lsn = 0;  // As respostas só esperam pelas transições deste pedido
+    switch (msg->type) {
+        case LOGIN_REQ:
+            timed_wrlock(&clients_lock);
+            handle_login(*msg);
+            timed_unlock(&clients_lock);
+            break;
+        case RIDE_REQ:
+            timed_wrlock(&services_lock);
+            handle_ride_request(*msg);
+            timed_unlock(&services_lock);
+            break;
+        case CANCEL_REQ:
+            timed_wrlock(&services_lock);
+            handle_cancel_request(*msg);
+            timed_unlock(&services_lock);
+            break;
+        case CONSULT_REQ:
+            handle_consult_request(*msg);
+            break;
+        case TERMINATE_REQ:
+            timed_wrlock(&clients_lock);
+            handle_client_exit(*msg);
+            timed_unlock(&clients_lock);
+            break;
+        default:
+            return;
+    }
+    stats_record(STAT_REQUEST_LOGIN + msg->type, stats_now_ns() - start);
+}
+
 // --- Lógica de Login ---
 void handle_login(ClientMessage msg) {
     // 1. Verificar se já existe
-    for (int i = 0; i < num_clients; i++) {
-        if (strcmp(clients[i].name, msg.client_name) == 0) {
-            send_response(msg.client_pid, 0, "Username em uso");
-            printf("\r\033[K[CONTROLADOR] Login falhou para %s: Username em uso.\nCMD> ", msg.client_name);
-            fflush(stdout);
-            return;
-        }
+    if (name_index_get(&client_by_name, msg.client_name) != -1) {
+        send_response(msg.client_pid, 0, "Username em uso");
+        log_write(LOG_INFO, "Login falhou para %s: Username em uso.", msg.client_name);
+        return;
     }
 
-    // 2. Verificar se cabe
-    if (num_clients >= MAX_CLIENTS) {
+    // 2. Reservar slot (a tabela cresce se estiver cheia)
+    int c = slab_alloc(&client_table);
+    if (c == -1) {
         send_response(msg.client_pid, 0, "Servidor cheio");
-        printf("\r\033[K[CONTROLADOR] Login falhou para %s: Servidor cheio.\nCMD> ", msg.client_name);
-        fflush(stdout);
+        log_write(LOG_INFO, "Login falhou para %s: Servidor cheio.", msg.client_name);
         return;
     }
 
-    // 3. Adicionar no final do array
-    clients[num_clients].pid = msg.client_pid;
-    strcpy(clients[num_clients].name, msg.client_name);
-    clients[num_clients].status = CLIENT_WAITING;
-    
-    num_clients++; 
+    // 3. Abrir o canal de resposta (mantém-se aberto até o cliente sair)
+    if (open_client_connection(msg.client_pid) == -1) {
+        slab_free(&client_table, c);
+        log_write(LOG_INFO, "Login falhou para %s: Pipe do cliente indisponível.", msg.client_name);
+        return;
+    }
+
+    // 4. Preencher o slot
+    clients[c].pid = msg.client_pid;
+    strcpy(clients[c].name, msg.client_name);
+    clients[c].status = CLIENT_WAITING;
+    int_index_put(&client_by_pid, msg.client_pid, c);
+    name_index_put(&client_by_name, msg.client_name, c);
 
     send_response(msg.client_pid, 1, "Bem-vindo!");
-    printf("\r\033[K[CONTROLADOR] Cliente %s (PID %d) logado com sucesso. Ativos: %d\nCMD> ", 
-        msg.client_name, msg.client_pid, num_clients);
-    fflush(stdout);
+    log_write(LOG_INFO, "Cliente %s (PID %d) logado com sucesso. Ativos: %d",
+              msg.client_name, msg.client_pid, client_table.count);
+
+    // 5. Reservas recuperadas de um arranque anterior passam para a nova sessão
+    if (wal_fd != -1) {
+        timed_wrlock(&services_lock);
+        int recovered = rebind_client_services(msg.client_name, msg.client_pid);
+        timed_unlock(&services_lock);
+        if (recovered > 0) {
+            char resp[BUFFER_SIZE];
+            sprintf(resp, "%d serviço(s) recuperado(s). Use 'consultar' para os ver.", recovered);
+            send_response(msg.client_pid, 1, resp);
+            log_write(LOG_INFO, "%d serviço(s) recuperado(s) para %s", recovered, msg.client_name);
+        }
+    }
 }
 
 // --- Lógica de Saída do Cliente ---
 void handle_client_exit(ClientMessage msg) {
-    int encontrado = 0;
+    int i = find_client(msg.client_pid);
+    if (i == -1) {
+        log_write(LOG_DEBUG, "Tentativa de logout de PID não encontrado: %d", msg.client_pid);
+        return;
+    }
+
+    // 1. Verificar se está em viagem
+    if (clients[i].status == CLIENT_ON_TRIP) {
+        send_response(msg.client_pid, 0, "Não pode sair. Está em viagem!");
+        log_write(LOG_INFO, "%s tentou sair mas está em viagem", msg.client_name);
+        return;
+    }
     
-    // 1. Vrificar se está em viageme
-    for (int i = 0; i < num_clients; i++) {
-        if (clients[i].pid == msg.client_pid) {
-            encontrado = 1;
-            
-            if (clients[i].status == CLIENT_ON_TRIP) {
-                send_response(msg.client_pid, 0, "Não pode sair. Está em viagem!");
-                printf("\r\033[K[CONTROLADOR] %s tentou sair mas está em viagem\nCMD> ", msg.client_name);
-                fflush(stdout);
-                return;
-            }
-            
-            // 2. Cancelar serviços agendados
-            int cancelled = 0;
-            for (int s = 0; s < num_services; s++) {
-                if (services[s].client_pid == msg.client_pid && services[s].status == STATUS_SCHEDULED) {
-                    services[s].status = STATUS_CANCELLED;
-                    cancelled++;
-                }
-            }
-            
-            if (cancelled > 0) {
-                printf("\r\033[K[CONTROLADOR] %d serviço(s) agendado(s) cancelado(s) para %s\nCMD> ", 
-                       cancelled, msg.client_name);
-                fflush(stdout);
-            }
-            
-            // 3. Remover cliente
-            for (int j = i; j < num_clients - 1; j++) {
-                clients[j] = clients[j + 1];
-            }
+    // 2. Despedir antes de fechar o canal
+    send_response(msg.client_pid, 1, "Até breve!");
 
-            num_clients--;
-            memset(&clients[num_clients], 0, sizeof(ClientInfo));
-            
-            send_response(msg.client_pid, 1, "Até breve!");
-            printf("\r\033[K[CONTROLADOR] Cliente %s saiu. Ativos: %d\nCMD> ", msg.client_name, num_clients);
-            fflush(stdout);
-            return;
+    // 3. Cancelar serviços agendados e remover cliente
+    int cancelled = remove_client(i);
+    if (cancelled > 0) {
+        log_write(LOG_INFO, "%d serviço(s) agendado(s) cancelado(s) para %s",
+                  cancelled, msg.client_name);
+    }
+    log_write(LOG_INFO, "Cliente %s saiu. Ativos: %d", msg.client_name, client_table.count);
+}
+
+// --- Remover Cliente (cancela agendados e fecha o canal; chamar com clients_lock em escrita) ---
+int remove_client(int client_idx) {
+    int client_pid = clients[client_idx].pid;
+
+    timed_wrlock(&services_lock);
+    int cancelled = 0;
+    for (int s = 0; s < service_table.high_water; s++) {
+        if (!service_table.used[s]) continue;
+        if (services[s].client_pid == client_pid && services[s].status == STATUS_SCHEDULED) {
+            set_service_status(s, STATUS_CANCELLED);
+            retire_service(s, 0);
+            cancelled++;
         }
     }
-    
-    if (!encontrado) {
-        //!DEBUG
-        // printf("\r\033[K[DEBUG] Tentativa de logout de PID não encontrado: %d\nCMD> ", msg.client_pid);
-        // fflush(stdout);
+    timed_unlock(&services_lock);
+
+    pthread_mutex_lock(&conn_mutex);
+    ClientConnection* conn = find_client_connection(client_pid);
+    if (conn != NULL) {
+        close_client_connection(conn);
+    }
+    pthread_mutex_unlock(&conn_mutex);
+
+    int_index_remove(&client_by_pid, client_pid);
+    name_index_remove(&client_by_name, clients[client_idx].name);
+    slab_free(&client_table, client_idx);
+    return cancelled;
+}
+
+// --- Cliente Morreu (pipe sem leitor; chamar sem locks) ---
+void handle_dead_client(int client_pid) {
+    timed_wrlock(&clients_lock);
+    int i = find_client(client_pid);
+    if (i != -1) {
+        char name[50];
+        strcpy(name, clients[i].name);
+        remove_client(i);
+        log_write(LOG_INFO, "Cliente %s (PID %d) desligou-se. Ativos: %d",
+                  name, client_pid, client_table.count);
+    }
+    timed_unlock(&clients_lock);
+}
+
+// --- Marcar Cliente como Morto (chamar com conn_mutex) ---
+void mark_client_dead(int client_pid) {
+    // Quem deteta a falha pode ter locks que remove_client precisa:
+    // fecha-se já o canal e a remoção fica para a thread de telemetria
+    ClientConnection* conn = find_client_connection(client_pid);
+    if (conn != NULL) {
+        close_client_connection(conn);
+    }
+
+    if (num_dead_clients == dead_clients_capacity) {
+        int new_capacity = dead_clients_capacity > 0 ? dead_clients_capacity * 2 : 16;
+        int* grown = realloc(dead_clients, new_capacity * sizeof(int));
+        if (grown == NULL) return;
+        dead_clients = grown;
+        dead_clients_capacity = new_capacity;
+    }
+    dead_clients[num_dead_clients++] = client_pid;
+
+    if (telemetry_pipe_write != -1) {
+        write(telemetry_pipe_write, "d", 1);
+    }
+}
+
+// --- Remover Clientes Marcados como Mortos (chamar sem locks) ---
+void reap_dead_clients() {
+    pthread_mutex_lock(&conn_mutex);
+    int* pids = dead_clients;
+    int count = num_dead_clients;
+    dead_clients = NULL;
+    num_dead_clients = 0;
+    dead_clients_capacity = 0;
+    pthread_mutex_unlock(&conn_mutex);
+
+    for (int i = 0; i < count; i++) {
+        handle_dead_client(pids[i]);
     }
+    free(pids);
+}
+
+// --- Alterar Estado do Cliente (basta clients_lock em leitura) ---
+void set_client_status(int client_idx, ClientStatus status) {
+    __atomic_store_n(&clients[client_idx].status, status, __ATOMIC_RELAXED);
+}
+
+// --- Alterar Estado do Serviço (chamar com services_lock em escrita) ---
+// As contagens por estado acompanham todas as transições (métricas)
+void set_service_status(int service_idx, ServiceStatus status) {
+    count_service_status(services[service_idx].status, -1);
+    services[service_idx].status = status;
+    count_service_status(status, 1);
+}
+
+void count_service_status(ServiceStatus status, int delta) {
+    if (status == STATUS_SCHEDULED) {
+        services_scheduled += delta;
+    } else if (status == STATUS_IN_PROGRESS) {
+        services_in_progress += delta;
+    }
+}
+
+// --- Procurar Cliente por PID (-1 se não existir) ---
+int find_client(int client_pid) {
+    return int_index_get(&client_by_pid, client_pid);
+}
+
+// --- Procurar Serviço por ID (-1 se não existir) ---
+int find_service(int service_id) {
+    return int_index_get(&service_by_id, service_id);
+}
+
+// --- Procurar Veículo por ID (-1 se não existir) ---
+int find_vehicle(int vehicle_id) {
+    // O ID é atribuído em add_vehicle como handle + 1
+    int v = vehicle_id - 1;
+    if (v < 0 || v >= vehicle_table.high_water || !vehicle_table.used[v]) return -1;
+    return v;
+}
+
+const char* client_name_of(int handle) {
+    return clients[handle].name;
 }
 
 // --- Lógica de Agendamento ---
@@ -258,27 +1249,31 @@ void handle_ride_request(ClientMessage msg) {
     // Parsear: agendar <hora> <local> <distancia>
     int hora;
     char local[100];
+    char destino[100] = "";
     double distancia;
     
-    if (sscanf(msg.data, "%d %99s %lf", &hora, local, &distancia) != 3) {
-        send_response(msg.client_pid, 0, "Formato inválido. Use: agendar <hora> <local> <distancia>");
+    if (sscanf(msg.data, "%d %99s %lf %99s", &hora, local, &distancia, destino) < 3) {
+        send_response(msg.client_pid, 0, "Formato inválido. Use: agendar <hora> <local> <distancia> [destino]");
         return;
     }
     
-    if (num_services >= MAX_SERVICES) {
-        send_response(msg.client_pid, 0, "Limite de serviços atingido");
+    Position pos;
+    if (locate_place(local, &pos) == -1 || (destino[0] != '\0' && locate_place(destino, &pos) == -1)) {
+        send_response(msg.client_pid, 0, "Local inválido");
         return;
     }
 
-    if (hora < simulated_time) {
+    int now = sim_time_now();
+    if (hora < now) {
         char err_msg[BUFFER_SIZE];
-        sprintf(err_msg, "Hora inválida. Deve ser no futuro. (Hora atual é %d)", simulated_time);
+        sprintf(err_msg, "Hora inválida. Deve ser no futuro. (Hora atual é %d)", now);
         send_response(msg.client_pid, 0, err_msg);
         return;
     }
     
     // Verificar se o cliente já tem uma viagem agendada ou em progresso
-    for (int i = 0; i < num_services; i++) {
+    for (int i = 0; i < service_table.high_water; i++) {
+        if (!service_table.used[i]) continue;
         if (services[i].client_pid == msg.client_pid && 
             (services[i].status == STATUS_SCHEDULED || services[i].status == STATUS_IN_PROGRESS)) {
             send_response(msg.client_pid, 0, "Já tem uma viagem agendada ou em progresso. Aguarde a conclusão.");
@@ -286,27 +1281,32 @@ void handle_ride_request(ClientMessage msg) {
         }
     }
     
-    // Criar serviço
-    services[num_services].id = next_service_id++;
-    strcpy(services[num_services].client_name, msg.client_name);
-    services[num_services].client_pid = msg.client_pid;
-    services[num_services].scheduled_time = hora;
-    strcpy(services[num_services].origem, local);
-    strcpy(services[num_services].destino, "");
-    services[num_services].vehicle_id = -1;
-    services[num_services].status = STATUS_SCHEDULED;
-    services[num_services].distance_km = distancia;
+    // Criar serviço (a tabela cresce se estiver cheia)
+    int s = slab_alloc(&service_table);
+    if (s == -1) {
+        send_response(msg.client_pid, 0, "Limite de serviços atingido");
+        return;
+    }
+    services[s].id = next_service_id++;
+    services[s].client_pid = msg.client_pid;
+    services[s].scheduled_time = hora;
+    set_service_detail(s, msg.client_name, local, destino);
+    services[s].vehicle_id = -1;
+    services[s].status = STATUS_SCHEDULED;
+    count_service_status(STATUS_SCHEDULED, 1);
+    services[s].distance_km = distancia;
+    int_index_put(&service_by_id, services[s].id, s);
+    wal_log_booking(s);
+    pending_push(s);
+    wake_scheduler_if_due();  // Pedido para agora: despachar sem esperar pelo próximo segundo
     
     char resp[BUFFER_SIZE];
     sprintf(resp, "Serviço agendado com ID %d para %02d:%02d:%02d", 
-            services[num_services].id, hora/3600, (hora%3600)/60, hora%60);
+            services[s].id, hora/3600, (hora%3600)/60, hora%60);
     send_response(msg.client_pid, 1, resp);
     
-    printf("\r\033[K[CONTROLADOR] Serviço ID %d agendado para %s (hora: %d, dist: %.1fkm)\nCMD> ", 
-           services[num_services].id, msg.client_name, hora, distancia);
-    fflush(stdout);
-    
-    num_services++;
+    log_write(LOG_INFO, "Serviço ID %d agendado para %s (hora: %d, dist: %.1fkm)",
+              services[s].id, msg.client_name, hora, distancia);
 }
 
 // --- Lógica de Cancelamento (Cliente) ---
@@ -316,10 +1316,12 @@ void handle_cancel_request(ClientMessage msg) {
     if (service_id == 0) {
         // Cancelar todos os serviços do cliente
         int cancelled = 0;
-        for (int i = 0; i < num_services; i++) {
+        for (int i = 0; i < service_table.high_water; i++) {
+            if (!service_table.used[i]) continue;
             if (services[i].client_pid == msg.client_pid && 
                 services[i].status == STATUS_SCHEDULED) {
-                services[i].status = STATUS_CANCELLED;
+                set_service_status(i, STATUS_CANCELLED);
+                retire_service(i, 0);
                 cancelled++;
             }
         }
@@ -327,573 +1329,3708 @@ void handle_cancel_request(ClientMessage msg) {
         char resp[BUFFER_SIZE];
         sprintf(resp, "%d serviço(s) cancelado(s)", cancelled);
         send_response(msg.client_pid, 1, resp);
-        printf("\r\033[K[CONTROLADOR] %s cancelou %d serviço(s)\nCMD> ", msg.client_name, cancelled);
+        log_write(LOG_INFO, "%s cancelou %d serviço(s)", msg.client_name, cancelled);
     } else {
         // Cancelar serviço específico
-        int found = 0;
-        for (int i = 0; i < num_services; i++) {
-            if (services[i].id == service_id && 
-                services[i].client_pid == msg.client_pid) {
-                found = 1;
-                
-                if (services[i].status != STATUS_SCHEDULED) {
-                    send_response(msg.client_pid, 0, "Serviço não pode ser cancelado (já em execução ou concluído)");
-                } else {
-                    services[i].status = STATUS_CANCELLED;
-                    send_response(msg.client_pid, 1, "Serviço cancelado com sucesso");
-                    printf("\r\033[K[CONTROLADOR] Serviço ID %d cancelado por %s\nCMD> ", service_id, msg.client_name);
-                }
-                break;
-            }
-        }
-        
-        if (!found) {
+        int i = find_service(service_id);
+        if (i == -1 || services[i].client_pid != msg.client_pid) {
             send_response(msg.client_pid, 0, "Serviço não encontrado ou não pertence a si");
+        } else if (services[i].status != STATUS_SCHEDULED) {
+            send_response(msg.client_pid, 0, "Serviço não pode ser cancelado (já em execução ou concluído)");
+        } else {
+            set_service_status(i, STATUS_CANCELLED);
+            retire_service(i, 0);
+            send_response(msg.client_pid, 1, "Serviço cancelado com sucesso");
+            log_write(LOG_INFO, "Serviço ID %d cancelado por %s", service_id, msg.client_name);
         }
     }
-    fflush(stdout);
 }
 
 // --- Lógica de Consulta ---
 void handle_consult_request(ClientMessage msg) {
-    char resp[BUFFER_SIZE * 4] = "[SERVIÇOS]\n";
+    // Texto sem limite fixo: send_response divide-o em vários frames se preciso
+    char* resp = NULL;
+    size_t resp_size = 0;
+    FILE* out = open_memstream(&resp, &resp_size);
+    if (out == NULL) {
+        send_response(msg.client_pid, 0, "Erro interno");
+        return;
+    }
+
+    fprintf(out, "[SERVIÇOS]\n");
     int count = 0;
     
-    for (int i = 0; i < num_services; i++) {
+    // Só leitura: corre em paralelo com outras consultas e com a telemetria de progresso
+    timed_rdlock(&services_lock);
+    for (int i = 0; i < service_table.high_water; i++) {
+        if (!service_table.used[i]) continue;
         if (services[i].client_pid == msg.client_pid && 
             (services[i].status == STATUS_SCHEDULED || services[i].status == STATUS_IN_PROGRESS)) {
-            char line[BUFFER_SIZE];
             const char* status_str = (services[i].status == STATUS_SCHEDULED) ? "AGENDADO" : "EM CURSO";
-            sprintf(line, "ID:%d | %02d:%02d:%02d | %s (%.1fkm) | %s\n",
+            fprintf(out, "ID:%d | %02d:%02d:%02d | %s (%.1fkm) | %s\n",
                     services[i].id,
                     services[i].scheduled_time/3600,
                     (services[i].scheduled_time%3600)/60,
                     services[i].scheduled_time%60,
-                    services[i].origem,
+                    string_of(service_details[i].origem_id),
                     services[i].distance_km,
                     status_str);
-            strcat(resp, line);
             count++;
         }
     }
+    timed_unlock(&services_lock);
+    fclose(out);
     
-    if (count == 0) {
-        strcpy(resp, "Não tem serviços agendados");
-    }
-    
-    send_response(msg.client_pid, 1, resp);
+    send_response(msg.client_pid, 1, count == 0 ? "Não tem serviços agendados" : resp);
+    free(resp);
 }
 
 // --- Lógica: Avisar Clientes do Encerramento ---
 void broadcast_shutdown() {
     printf("[CONTROLADOR] A avisar clientes do encerramento...\n");
-    pthread_mutex_lock(&data_mutex);
-    for (int i = 0; i < num_clients; i++) {
-        send_response(clients[i].pid, 0, "SERVER_SHUTDOWN");
+    timed_rdlock(&clients_lock);
+    for (int i = 0; i < client_table.high_water; i++) {
+        if (client_table.used[i]) {
+            send_response(clients[i].pid, 0, "SERVER_SHUTDOWN");
+        }
     }
-    pthread_mutex_unlock(&data_mutex);
+    timed_unlock(&clients_lock);
 }
 
-// --- Envio de Resposta ---
-void send_response(int client_pid, int success, char* text) {
+// --- Abrir Canal Persistente para o Cliente ---
+int open_client_connection(int client_pid) {
     char pipe_client_path[50];
     sprintf(pipe_client_path, PIPE_CLIENT_FMT, client_pid);
 
+    // O_NONBLOCK: falha logo (ENXIO) se o cliente não tiver o pipe aberto
+    int fd = open(pipe_client_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) return -1;
 
-    //!DEBUG
-    //printf("\r\033[K[DEBUG:CONTROLADOR] A tentar abrir pipe: %s\nCMD> ", pipe_client_path);
-    //fflush(stdout);
-
-    int fd_cli = open(pipe_client_path, O_WRONLY);
-    if (fd_cli == -1) {
-        printf("\r\033[K[CONTROLADOR] Erro: Não consegui abrir pipe do cliente %d\nCMD> ", client_pid);
-        fflush(stdout);
-        return;
+    pthread_mutex_lock(&conn_mutex);
+    int handle = slab_alloc(&conn_table);
+    if (handle == -1) {
+        pthread_mutex_unlock(&conn_mutex);
+        close(fd);
+        return -1;
     }
 
-    ControllerResponse resp;
-    resp.success = success;
-    strcpy(resp.message, text);
-    
-    write(fd_cli, &resp, sizeof(ControllerResponse));
-    close(fd_cli);
+    ClientConnection* conn = &client_conns[handle];
+    int_index_put(&conn_by_pid, client_pid, handle);
+    conn->pid = client_pid;
+    conn->fd = fd;
+    conn->head = 0;
+    conn->count = 0;
+    pthread_mutex_unlock(&conn_mutex);
+    return 0;
+}
 
-    //!DEBUG
-    //printf("\r\033[K[DEBUG:CONTROLADOR] Resposta enviada para %d: %s\nCMD> ", client_pid, text);
-    //fflush(stdout);
+// --- Procurar Canal do Cliente ---
+ClientConnection* find_client_connection(int client_pid) {
+    int handle = int_index_get(&conn_by_pid, client_pid);
+    return handle == -1 ? NULL : &client_conns[handle];
 }
 
-// --- Inicialização de Veículos ---
-void init_vehicles() {
-    for (int i = 0; i < MAX_VEHICLES; i++) {
-        vehicles[i].id = i + 1;
-        vehicles[i].active = VEHICLE_INACTIVE;
-        vehicles[i].available = VEHICLE_AVAILABLE;
-        vehicles[i].progress_percent = 0;
-        vehicles[i].service_id = -1;
-        vehicles[i].process_pid = 0;
-        vehicles[i].total_km = 0.0;
-        vehicle_telemetry_fds[i] = -1;
-        
-        // Criar pipe de telemetria antecipadamente
-        char pipe_path[50];
-        sprintf(pipe_path, PIPE_VEHICLE_FMT, vehicles[i].id);
-        if (mkfifo(pipe_path, 0666) == -1 && errno != EEXIST) {
-            // Pipe já existe ou erro, ignorar
+// --- Fechar Canal do Cliente ---
+void close_client_connection(ClientConnection* conn) {
+    if (conn->count > 0) {
+        // Última tentativa de entregar o que ficou em fila
+        if (flush_client_connection(conn) == 0 && conn->count > 0) {
+            epoll_ctl(telemetry_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
         }
     }
-    num_vehicles = MAX_VEHICLES;
-    printf("[CONTROLADOR] %d veículos inicializados.\n", num_vehicles);
+    while (conn->count > 0) {
+        free(conn->queue[conn->head]);
+        conn->head = (conn->head + 1) % CLIENT_QUEUE_SIZE;
+        conn->count--;
+    }
+    close(conn->fd);
+    int_index_remove(&conn_by_pid, conn->pid);
+    slab_free(&conn_table, (int)(conn - client_conns));
 }
 
-// --- Thread Scheduler ---
-void* scheduler_thread(void* arg) {
-    while (keep_running) {
-        sleep(1);
-        
-        pthread_mutex_lock(&data_mutex);
-        
-        // Verificar serviços agendados que devem ser iniciados
-        for (int i = 0; i < num_services; i++) {
-            if (services[i].status == STATUS_SCHEDULED &&
-                services[i].scheduled_time <= simulated_time &&
-                services[i].vehicle_id == -1) {
-                
-                // Encontrar veículo disponível
-                int vehicle_idx = find_available_vehicle();
-                if (vehicle_idx != -1) {
-                    services[i].vehicle_id = vehicles[vehicle_idx].id;
-                    services[i].status = STATUS_IN_PROGRESS;
-                    vehicles[vehicle_idx].available = VEHICLE_OCCUPIED;
-                    vehicles[vehicle_idx].service_id = services[i].id;
-                    
-                    // Atualizar cliente para em viagem
-                    for (int c = 0; c < num_clients; c++) {
-                        if (clients[c].pid == services[i].client_pid) {
-                            clients[c].status = CLIENT_ON_TRIP;
-                            break;
-                        }
-                    }
-
-                    printf("\r\033[K[CONTROLADOR] Lançando veículo %d para serviço ID %d\nCMD> ", 
-                           vehicles[vehicle_idx].id, services[i].id);
-                    fflush(stdout);
-                    
-                    launch_vehicle(i);
-                }
-            }
+// --- Escrever Respostas Pendentes (-1 se o cliente morreu) ---
+int flush_client_connection(ClientConnection* conn) {
+    while (conn->count > 0) {
+        // Frames <= PIPE_BUF: a escrita é atómica (tudo ou EAGAIN)
+        ssize_t n = write(conn->fd, conn->queue[conn->head], conn->queue_len[conn->head]);
+        if (n == -1) {
+            if (errno == EAGAIN) return 0;  // Pipe cheio, o epoll avisa quando houver espaço
+            epoll_ctl(telemetry_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+            return -1;
         }
-        
-        pthread_mutex_unlock(&data_mutex);
-    }
-    return NULL;
-}
+        free(conn->queue[conn->head]);
+        conn->head = (conn->head + 1) % CLIENT_QUEUE_SIZE;
+        conn->count--;
 
-// --- Encontrar Veículo Disponível ---
-int find_available_vehicle() {
-    for (int i = 0; i < num_vehicles; i++) {
-        if (vehicles[i].available) {
-            return i;
+        if (conn->count == 0) {
+            // Fila vazia: deixar de vigiar o pipe
+            epoll_ctl(telemetry_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
         }
     }
-    return -1;
+    return 0;
 }
 
-// --- Lançar Veículo ---
-void launch_vehicle(int service_index) {
-    ServiceInfo *srv = &services[service_index];
-    
-    // Criar named pipe para telemetria do veículo
-    char pipe_vehicle_path[50];
-    sprintf(pipe_vehicle_path, PIPE_VEHICLE_FMT, srv->vehicle_id);
-    
-    // Remover pipe antigo se existir
-    unlink(pipe_vehicle_path);
-    
-    // Criar novo pipe
-    if (mkfifo(pipe_vehicle_path, 0666) == -1) {
-        perror("[CONTROLADOR] Erro ao criar pipe de veículo");
-        return;
+// --- Enviar (ou pôr em fila) um Frame (-1 se o cliente morreu) ---
+int send_frame_to_client(ClientConnection* conn, const char* frame, int len) {
+    // Escrita direta se não houver nada em fila (mantém a ordem das respostas)
+    if (conn->count == 0) {
+        ssize_t n = write(conn->fd, frame, len);
+        if (n == len) return 0;
+        if (n == -1 && errno != EAGAIN) return -1;
     }
-    
-    // Resetar o FD da telemetria para este veículo
-    int vehicle_idx = srv->vehicle_id - 1;
-    if (vehicle_telemetry_fds[vehicle_idx] != -1) {
-        close(vehicle_telemetry_fds[vehicle_idx]);
+
+    if (conn->count >= CLIENT_QUEUE_SIZE) {
+        log_write(LOG_WARN, "Fila do cliente %d cheia, resposta descartada", conn->pid);
+        return 0;
     }
-    vehicle_telemetry_fds[vehicle_idx] = -1;
-    
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("[CONTROLADOR] Erro ao fazer fork para veículo");
-        return;
+
+    int tail = (conn->head + conn->count) % CLIENT_QUEUE_SIZE;
+    conn->queue[tail] = malloc(len);
+    if (conn->queue[tail] == NULL) return 0;
+    memcpy(conn->queue[tail], frame, len);
+    conn->queue_len[tail] = len;
+    conn->count++;
+
+    if (conn->count == 1) {
+        // Primeiro frame em fila: pedir ao epoll para avisar quando o pipe tiver espaço
+        struct epoll_event ev;
+        ev.events = EPOLLOUT;
+        ev.data.u32 = CLIENT_CONN_TAG | (uint32_t)(conn - client_conns);
+        epoll_ctl(telemetry_epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
     }
-    
-    if (pid == 0) {
-        // Processo filho (veículo)
-        
-        // Preparar argumentos
-        char arg_id[20], arg_service[20], arg_client[20], arg_dist[20];
-        sprintf(arg_id, "%d", srv->vehicle_id);
-        sprintf(arg_service, "%d", srv->id);
-        sprintf(arg_client, "%d", srv->client_pid);
-        sprintf(arg_dist, "%.1f", srv->distance_km);
-        
-        // Executar veículo
-        execl("./veiculo", "veiculo", arg_id, arg_service, arg_client, 
-              srv->origem, arg_dist, NULL);
-        
-        perror("\r\033[K[VEICULO] Erro ao executar");
-        exit(1);
-    } else {
-        // Processo pai (controlador)
-        
-        // Atualizar processo do veículo
-        for (int i = 0; i < num_vehicles; i++) {
-            if (vehicles[i].id == srv->vehicle_id) {
-                vehicles[i].process_pid = pid;
-                vehicles[i].active = VEHICLE_ACTIVE;
-                break;
-            }
+    return 0;
+}
+
+// --- Envio de Resposta (codifica e deixa para a thread de escrita) ---
+void send_response(int client_pid, int success, char* text) {
+    size_t total = strlen(text);
+    size_t frames = total / FRAME_MAX_PAYLOAD + 1;
+    size_t needed = frames * (sizeof(ResponseRecord) + FRAME_MAX_SIZE);
+
+    pthread_mutex_lock(&outbox_mutex);
+    if (outbox_size + needed > outbox_capacity) {
+        size_t new_capacity = outbox_capacity > 0 ? outbox_capacity * 2 : 16384;
+        while (new_capacity < outbox_size + needed) new_capacity *= 2;
+        char* grown = realloc(outbox, new_capacity);
+        if (grown == NULL) {
+            pthread_mutex_unlock(&outbox_mutex);
+            log_write(LOG_WARN, "Sem memória, resposta ao cliente %d descartada", client_pid);
+            return;
         }
+        outbox = grown;
+        outbox_capacity = new_capacity;
+    }
+    int was_empty = (outbox_size == 0);
+    uint64_t queued_ns = stats_now_ns();
+
+    // Dividir o texto em frames (o último sem FRAME_F_MORE)
+    size_t offset = 0;
+    do {
+        size_t chunk = total - offset;
+        if (chunk > FRAME_MAX_PAYLOAD) chunk = FRAME_MAX_PAYLOAD;
+
+        uint8_t flags = success ? FRAME_F_SUCCESS : 0;
+        if (offset + chunk < total) flags |= FRAME_F_MORE;
+
+        ResponseRecord rec;
+        rec.client_pid = client_pid;
+        rec.queued_ns = (flags & FRAME_F_MORE) ? 0 : queued_ns;  // Mede-se a resposta, não cada frame
+        rec.wal_lsn = wal_last_lsn;
+        rec.len = (uint16_t)frame_encode(outbox + outbox_size + sizeof(ResponseRecord), OP_RESPONSE,
+                                         flags, getpid(), text + offset, chunk);
+        memcpy(outbox + outbox_size, &rec, sizeof(ResponseRecord));
+        outbox_size += sizeof(ResponseRecord) + rec.len;
+        offset += chunk;
+    } while (offset < total);
+
+    if (was_empty) {
+        pthread_cond_signal(&outbox_cond);
     }
+    pthread_mutex_unlock(&outbox_mutex);
 }
 
-// --- Thread de Telemetria de Veículos ---
-void* vehicle_telemetry_thread(void* arg) {
-    char buffer[BUFFER_SIZE];
-    
+// --- Thread de Escrita de Respostas ---
+void* response_writer_thread(void* arg) {
     while (keep_running) {
-        // Tentar abrir e ler de cada pipe de veículo (dinâmico)
-        int has_data = 0;
-        for (int i = 0; i < MAX_VEHICLES; i++) {
-            int vehicle_num = i + 1;
-            char pipe_path[50];
-            sprintf(pipe_path, PIPE_VEHICLE_FMT, vehicle_num);
-            
-            // Se o FD ainda não foi aberto, tentar abrir
-            if (vehicle_telemetry_fds[i] == -1) {
-                vehicle_telemetry_fds[i] = open(pipe_path, O_RDONLY | O_NONBLOCK);
-            }
-            
-            // Se o FD está aberto, tentar ler
-            if (vehicle_telemetry_fds[i] != -1) {
-                ssize_t n = read(vehicle_telemetry_fds[i], buffer, sizeof(buffer) - 1);
-                if (n > 0) {
-                    has_data = 1;
-                    buffer[n] = '\0';
-                    
-                    // Processar cada linha
-                    char* line = strtok(buffer, "\n");
-                    while (line != NULL) {
-                        if (strlen(line) > 0) {
-                            process_vehicle_telemetry(line, vehicle_num);
-                        }
-                        line = strtok(NULL, "\n");
-                    }
-                } else if (n < 0 && errno == EBADF) {
-                    // Pipe foi fechado
-                    close(vehicle_telemetry_fds[i]);
-                    vehicle_telemetry_fds[i] = -1;
-                }
-            }
+        pthread_mutex_lock(&outbox_mutex);
+        while (outbox_size == 0 && keep_running) {
+            pthread_cond_wait(&outbox_cond, &outbox_mutex);
         }
-        
-        // Se não houver dados, aguardar um pouco
-        if (!has_data) {
-            usleep(50000);  // 50ms
+        pthread_mutex_unlock(&outbox_mutex);
+
+        write_responses();
+    }
+    return NULL;
+}
+
+// --- Escrever Respostas Acumuladas (um lote por troca de buffers) ---
+void write_responses() {
+    pthread_mutex_lock(&writer_mutex);
+
+    pthread_mutex_lock(&outbox_mutex);
+    char* batch = outbox;
+    size_t batch_size = outbox_size;
+    size_t batch_capacity = outbox_capacity;
+    outbox = outbox_spare;
+    outbox_capacity = outbox_spare_capacity;
+    outbox_size = 0;
+    pthread_mutex_unlock(&outbox_mutex);
+
+    pthread_mutex_lock(&conn_mutex);
+    uint64_t synced_lsn = 0;
+    int unsynced = 0;
+    size_t offset = 0;
+    while (offset < batch_size) {
+        ResponseRecord rec;
+        memcpy(&rec, batch + offset, sizeof(ResponseRecord));
+        const char* frame = batch + offset + sizeof(ResponseRecord);
+        offset += sizeof(ResponseRecord) + rec.len;
+
+        // Uma resposta só sai depois de a transição que a originou estar em disco;
+        // as que não alteraram nada (consultas, recusas) não esperam
+        if (rec.wal_lsn > synced_lsn) {
+            pthread_mutex_unlock(&conn_mutex);
+            if (wal_sync(rec.wal_lsn) == -1) unsynced = 1;
+            synced_lsn = rec.wal_lsn;
+            pthread_mutex_lock(&conn_mutex);
+        }
+
+        if (rec.queued_ns != 0) {
+            stats_record(STAT_RESPONSE_DELIVERY, stats_now_ns() - rec.queued_ns);
+        }
+
+        ClientConnection* conn = find_client_connection(rec.client_pid);
+        if (conn != NULL) {
+            if (send_frame_to_client(conn, frame, rec.len) == -1) {
+                mark_client_dead(rec.client_pid);
+            }
+            continue;
+        }
+
+        // Cliente sem sessão (ex: login recusado ou já saiu): envio único, sem bloquear
+        char pipe_client_path[50];
+        sprintf(pipe_client_path, PIPE_CLIENT_FMT, rec.client_pid);
+        int fd_cli = open(pipe_client_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd_cli == -1) {
+            log_write(LOG_ERROR, "Não consegui abrir pipe do cliente %d", rec.client_pid);
+            continue;
+        }
+        write(fd_cli, frame, rec.len);
+        close(fd_cli);
+    }
+    pthread_mutex_unlock(&conn_mutex);
+
+    if (unsynced) {
+        log_write(LOG_WARN, "Log de estado em falha: respostas enviadas sem as transições em disco");
+    }
+
+    // O lote escrito passa a ser o buffer livre
+    outbox_spare = batch;
+    outbox_spare_capacity = batch_capacity;
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+// --- Inicialização de Veículos ---
+void init_vehicles() {
+    int nveiculos = atoi(getenv("NVEICULOS"));
+    for (int i = 0; i < nveiculos; i++) {
+        if (add_vehicle() == -1) {
+            perror("[CONTROLADOR] Erro ao criar veículo");
+            exit(1);
+        }
+    }
+    printf("[CONTROLADOR] %d veículos inicializados.\n", vehicle_table.count);
+}
+
+// --- Adicionar Veículo à Frota (devolve o índice) ---
+int add_vehicle() {
+    int v = slab_alloc(&vehicle_table);
+    if (v == -1) return -1;
+
+    // Uma referência de grelha por veículo
+    if (grid_refs_capacity < vehicle_table.capacity) {
+        GridRef* grown = realloc(grid_refs, vehicle_table.capacity * sizeof(GridRef));
+        if (grown == NULL) {
+            slab_free(&vehicle_table, v);
+            return -1;
+        }
+        grid_refs = grown;
+        grid_refs_capacity = vehicle_table.capacity;
+    }
+    grid_refs[v].bucket = -1;
+
+    vehicles[v].id = v + 1;
+    vehicles[v].active = VEHICLE_INACTIVE;
+    vehicles[v].available = VEHICLE_OCCUPIED;  // release_vehicle coloca-o na grelha
+    vehicles[v].progress_percent = 0;
+    vehicles[v].service_id = -1;
+    vehicles[v].process_pid = 0;
+    vehicles[v].total_km = 0.0;
+    vehicles[v].telemetry_fd = -1;
+    vehicles[v].command_fd = -1;
+    vehicles[v].position = known_places[v % num_known_places].pos;  // Frota espalhada pelos locais
+
+    if (internal_simulation) {
+        // Simulado pelas threads do próprio controlador: sem pipe nem processo
+        vehicles[v].process_pid = getpid();
+        release_vehicle(v);
+        return v;
+    }
+    
+    // Criar pipe de telemetria (dura toda a vida do veículo)
+    char pipe_path[50];
+    sprintf(pipe_path, PIPE_VEHICLE_FMT, vehicles[v].id);
+    if (telemetry_shm == NULL && mkfifo(pipe_path, 0666) == -1 && errno != EEXIST) {
+        slab_free(&vehicle_table, v);
+        return -1;
+    }
+
+    // Lançar já o processo do veículo: cada viagem é só uma mensagem
+    if (spawn_vehicle_worker(v) == -1) {
+        slab_free(&vehicle_table, v);
+        return -1;
+    }
+    release_vehicle(v);
+    return v;
+}
+
+// --- Tabelas Dinâmicas (Slab) ---
+void slab_init(Slab* slab, void** items, size_t item_size, int capacity) {
+    if (capacity < 1) capacity = 1;
+
+    slab->items = items;
+    slab->item_size = item_size;
+    slab->detail_items = NULL;
+    slab->detail_size = 0;
+    slab->capacity = capacity;
+    slab->num_free = 0;
+    slab->high_water = 0;
+    slab->count = 0;
+    *items = calloc(capacity, item_size);
+    slab->used = calloc(capacity, 1);
+    slab->free_slots = malloc(capacity * sizeof(int));
+    if (*items == NULL || slab->used == NULL || slab->free_slots == NULL) {
+        perror("[CONTROLADOR] Erro ao alocar tabela");
+        exit(1);
+    }
+}
+
+// Segundo array com os mesmos handles (campos raramente lidos, fora dos varrimentos)
+void slab_attach(Slab* slab, void** items, size_t item_size) {
+    slab->detail_items = items;
+    slab->detail_size = item_size;
+    *items = calloc(slab->capacity, item_size);
+    if (*items == NULL) {
+        perror("[CONTROLADOR] Erro ao alocar tabela");
+        exit(1);
+    }
+}
+
+// Todos os arrays crescem antes de a capacidade mudar: numa falha a meio os que
+// já cresceram ficam só maiores do que o preciso e a tabela continua coerente
+int slab_grow(Slab* slab) {
+    int old_capacity = slab->capacity;
+    int new_capacity = old_capacity * 2;
+
+    void* items = realloc(*slab->items, new_capacity * slab->item_size);
+    if (items == NULL) return -1;
+    *slab->items = items;
+
+    void* details = NULL;
+    if (slab->detail_items != NULL) {
+        details = realloc(*slab->detail_items, new_capacity * slab->detail_size);
+        if (details == NULL) return -1;
+        *slab->detail_items = details;
+    }
+
+    unsigned char* used = realloc(slab->used, new_capacity);
+    if (used == NULL) return -1;
+    slab->used = used;
+
+    int* free_slots = realloc(slab->free_slots, new_capacity * sizeof(int));
+    if (free_slots == NULL) return -1;
+    slab->free_slots = free_slots;
+
+    memset((char*)items + old_capacity * slab->item_size, 0, (new_capacity - old_capacity) * slab->item_size);
+    if (details != NULL) {
+        memset((char*)details + old_capacity * slab->detail_size, 0, (new_capacity - old_capacity) * slab->detail_size);
+    }
+    memset(used + old_capacity, 0, new_capacity - old_capacity);
+    slab->capacity = new_capacity;
+    return 0;
+}
+
+int slab_alloc(Slab* slab) {
+    int handle;
+    if (slab->num_free > 0) {
+        handle = slab->free_slots[--slab->num_free];
+    } else {
+        if (slab->high_water == slab->capacity && slab_grow(slab) == -1) {
+            return -1;
+        }
+        handle = slab->high_water++;
+    }
+
+    memset((char*)*slab->items + handle * slab->item_size, 0, slab->item_size);
+    if (slab->detail_items != NULL) {
+        memset((char*)*slab->detail_items + handle * slab->detail_size, 0, slab->detail_size);
+    }
+    slab->used[handle] = 1;
+    slab->count++;
+    return handle;
+}
+
+void slab_free(Slab* slab, int handle) {
+    if (!slab->used[handle]) return;
+
+    // Limpar o slot: pid/id a 0 deixa de corresponder a pesquisas
+    memset((char*)*slab->items + handle * slab->item_size, 0, slab->item_size);
+    if (slab->detail_items != NULL) {
+        memset((char*)*slab->detail_items + handle * slab->detail_size, 0, slab->detail_size);
+    }
+    slab->used[handle] = 0;
+    slab->free_slots[slab->num_free++] = handle;
+    slab->count--;
+}
+
+// --- Índices Hash ---
+uint32_t hash_int(int key) {
+    return (uint32_t)key * 2654435761u;  // Hash multiplicativo de Knuth
+}
+
+uint32_t hash_string(const char* key) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void int_index_init(IntIndex* index, int capacity) {
+    int cap = 8;
+    while (cap < capacity) cap *= 2;
+
+    index->keys = malloc(cap * sizeof(int));
+    index->values = malloc(cap * sizeof(int));
+    if (index->keys == NULL || index->values == NULL) {
+        perror("[CONTROLADOR] Erro ao alocar índice");
+        exit(1);
+    }
+    for (int i = 0; i < cap; i++) index->values[i] = INDEX_EMPTY;
+    index->capacity = cap;
+    index->used = 0;
+}
+
+int int_index_get(IntIndex* index, int key) {
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash_int(key) & mask; index->values[i] != INDEX_EMPTY; i = (i + 1) & mask) {
+        if (index->values[i] >= 0 && index->keys[i] == key) {
+            return index->values[i];
+        }
+    }
+    return -1;
+}
+
+void int_index_put(IntIndex* index, int key, int handle) {
+    // Manter a ocupação (incluindo removidas) abaixo de 75%
+    if ((index->used + 1) * 4 > index->capacity * 3) {
+        int* old_keys = index->keys;
+        int* old_values = index->values;
+        int old_capacity = index->capacity;
+
+        int live = 0;
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_values[i] >= 0) live++;
+        }
+        // Só cresce se as entradas vivas o justificarem; senão limpa as removidas
+        int_index_init(index, (live + 1) * 4 > old_capacity * 2 ? old_capacity * 2 : old_capacity);
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_values[i] >= 0) int_index_put(index, old_keys[i], old_values[i]);
+        }
+        free(old_keys);
+        free(old_values);
+    }
+
+    uint32_t mask = index->capacity - 1;
+    int slot = -1;
+    uint32_t i;
+    for (i = hash_int(key) & mask; index->values[i] != INDEX_EMPTY; i = (i + 1) & mask) {
+        if (index->values[i] >= 0 && index->keys[i] == key) {
+            index->values[i] = handle;  // Atualizar entrada existente
+            return;
+        }
+        if (index->values[i] == INDEX_DELETED && slot == -1) slot = i;
+    }
+    if (slot == -1) {
+        slot = i;
+        index->used++;
+    }
+    index->keys[slot] = key;
+    index->values[slot] = handle;
+}
+
+void int_index_remove(IntIndex* index, int key) {
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash_int(key) & mask; index->values[i] != INDEX_EMPTY; i = (i + 1) & mask) {
+        if (index->values[i] >= 0 && index->keys[i] == key) {
+            index->values[i] = INDEX_DELETED;
+            return;
+        }
+    }
+}
+
+void name_index_init(NameIndex* index, int capacity, const char* (*key_of)(int handle)) {
+    int cap = 8;
+    while (cap < capacity) cap *= 2;
+
+    index->hashes = malloc(cap * sizeof(uint32_t));
+    index->values = malloc(cap * sizeof(int));
+    if (index->hashes == NULL || index->values == NULL) {
+        perror("[CONTROLADOR] Erro ao alocar índice");
+        exit(1);
+    }
+    for (int i = 0; i < cap; i++) index->values[i] = INDEX_EMPTY;
+    index->capacity = cap;
+    index->used = 0;
+    index->key_of = key_of;
+}
+
+int name_index_get(NameIndex* index, const char* key) {
+    uint32_t h = hash_string(key);
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = h & mask; index->values[i] != INDEX_EMPTY; i = (i + 1) & mask) {
+        if (index->values[i] >= 0 && index->hashes[i] == h &&
+            strcmp(index->key_of(index->values[i]), key) == 0) {
+            return index->values[i];
+        }
+    }
+    return -1;
+}
+
+void name_index_put(NameIndex* index, const char* key, int handle) {
+    if ((index->used + 1) * 4 > index->capacity * 3) {
+        uint32_t* old_hashes = index->hashes;
+        int* old_values = index->values;
+        int old_capacity = index->capacity;
+
+        int live = 0;
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_values[i] >= 0) live++;
+        }
+        name_index_init(index, (live + 1) * 4 > old_capacity * 2 ? old_capacity * 2 : old_capacity,
+                        index->key_of);
+
+        // Reinserir pelo hash guardado (sem recalcular nem comparar nomes)
+        uint32_t mask = index->capacity - 1;
+        for (int j = 0; j < old_capacity; j++) {
+            if (old_values[j] < 0) continue;
+            uint32_t i = old_hashes[j] & mask;
+            while (index->values[i] != INDEX_EMPTY) i = (i + 1) & mask;
+            index->hashes[i] = old_hashes[j];
+            index->values[i] = old_values[j];
+            index->used++;
+        }
+        free(old_hashes);
+        free(old_values);
+    }
+
+    uint32_t h = hash_string(key);
+    uint32_t mask = index->capacity - 1;
+    int slot = -1;
+    uint32_t i;
+    for (i = h & mask; index->values[i] != INDEX_EMPTY; i = (i + 1) & mask) {
+        if (index->values[i] >= 0 && index->hashes[i] == h &&
+            strcmp(index->key_of(index->values[i]), key) == 0) {
+            index->values[i] = handle;
+            return;
+        }
+        if (index->values[i] == INDEX_DELETED && slot == -1) slot = i;
+    }
+    if (slot == -1) {
+        slot = i;
+        index->used++;
+    }
+    index->hashes[slot] = h;
+    index->values[slot] = handle;
+}
+
+void name_index_remove(NameIndex* index, const char* key) {
+    uint32_t h = hash_string(key);
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = h & mask; index->values[i] != INDEX_EMPTY; i = (i + 1) & mask) {
+        if (index->values[i] >= 0 && index->hashes[i] == h &&
+            strcmp(index->key_of(index->values[i]), key) == 0) {
+            index->values[i] = INDEX_DELETED;
+            return;
+        }
+    }
+}
+
+// --- Textos Partilhados (chamar com services_lock; em escrita para intern/release) ---
+// Devolve o handle do texto com mais uma referência (-1 sem memória: lê-se como "")
+int string_intern(const char* text) {
+    int handle = name_index_get(&string_by_text, text);
+    if (handle != -1) {
+        strings[handle].refs++;
+        return handle;
+    }
+
+    char* copy = strdup(text);
+    if (copy == NULL) return -1;
+    handle = slab_alloc(&string_table);
+    if (handle == -1) {
+        free(copy);
+        return -1;
+    }
+    strings[handle].text = copy;
+    strings[handle].refs = 1;
+    name_index_put(&string_by_text, copy, handle);
+    return handle;
+}
+
+void string_release(int handle) {
+    if (handle == -1 || --strings[handle].refs > 0) return;
+
+    name_index_remove(&string_by_text, strings[handle].text);
+    free(strings[handle].text);
+    slab_free(&string_table, handle);
+}
+
+const char* string_of(int handle) {
+    return handle == -1 ? "" : strings[handle].text;
+}
+
+// --- Campos Frios de um Serviço Novo ---
+void set_service_detail(int service_idx, const char* client_name, const char* origem, const char* destino) {
+    ServiceDetail* detail = &service_details[service_idx];
+    detail->client_name_id = string_intern(client_name);
+    detail->origem_id = string_intern(origem);
+    detail->destino_id = string_intern(destino);
+    // Locais sem coordenadas conhecidas são servidos a partir da base
+    detail->has_origin_pos = locate_place(origem, &detail->origin_pos) == 1;
+    detail->has_dest_pos = destino[0] != '\0' && locate_place(destino, &detail->dest_pos) == 1;
+}
+
+// --- Thread Scheduler ---
+void* scheduler_thread(void* arg) {
+    while (keep_running) {
+        uint64_t tick_start = stats_now_ns();
+        dispatch_due_services();
+        stats_record(STAT_SCHEDULER_TICK, stats_now_ns() - tick_start);
+
+        // Dormir até haver trabalho: novo pedido, avanço do tempo ou veículo libertado
+        pthread_mutex_lock(&scheduler_mutex);
+        while (!scheduler_signalled && keep_running) {
+            pthread_cond_wait(&scheduler_cond, &scheduler_mutex);
+        }
+        scheduler_signalled = 0;
+        pthread_mutex_unlock(&scheduler_mutex);
+    }
+    return NULL;
+}
+
+// --- Acordar o Scheduler (sem locks de dados: usa next_due_time) ---
+void wake_scheduler_if_due() {
+    if (atomic_load(&next_due_time) <= sim_time_now()) {
+        pthread_mutex_lock(&scheduler_mutex);
+        scheduler_signalled = 1;
+        pthread_cond_signal(&scheduler_cond);
+        pthread_mutex_unlock(&scheduler_mutex);
+    }
+}
+
+// --- Despachar Serviços ---
+void dispatch_due_services() {
+    timed_rdlock(&clients_lock);
+    timed_wrlock(&services_lock);
+    timed_wrlock(&fleet_lock);
+
+    int now = sim_time_now();
+    if (batch_dispatch) {
+        // Lotes até acabarem os serviços vencidos ou os veículos livres
+        while (dispatch_batch(now) > 0);
+    }
+
+    // Despachar serviços cujo scheduled_time já chegou (topo do heap)
+    while (num_pending > 0 && pending_heap[0].scheduled_time <= now) {
+        int i = pending_heap[0].service_idx;
+
+        // Entrada obsoleta: serviço cancelado depois de agendado
+        if (services[i].id != pending_heap[0].service_id || services[i].status != STATUS_SCHEDULED) {
+            pending_pop();
+            continue;
+        }
+        if (services[i].client_pid == 0) {
+            pending_pop();
+            cancel_unclaimed_service(i);
+            continue;
+        }
+
+        // Veículo livre mais próximo da origem
+        int vehicle_idx = take_available_vehicle(service_origin(i));
+        if (vehicle_idx == -1) break;  // O serviço fica no topo até um ser libertado
+        pending_pop();
+        assign_vehicle(i, vehicle_idx);
+    }
+
+    // Veículos com falha passageira no lançamento só voltam à grelha agora: no mesmo
+    // despacho o serviço devolvido à fila seria logo reatribuído ao mesmo veículo
+    for (int k = 0; k < num_launch_retry; k++) {
+        release_vehicle(launch_retry[k]);
+    }
+    num_launch_retry = 0;
+
+    timed_unlock(&fleet_lock);
+    timed_unlock(&services_lock);
+    timed_unlock(&clients_lock);
+}
+
+// --- Devolver Veículo à Grelha no Fim do Despacho (chamar com fleet_lock em escrita) ---
+void defer_vehicle_release(int vehicle_idx) {
+    if (num_launch_retry == launch_retry_capacity) {
+        int new_capacity = launch_retry_capacity > 0 ? launch_retry_capacity * 2 : 8;
+        int* grown = realloc(launch_retry, new_capacity * sizeof(int));
+        if (grown == NULL) {
+            log_write(LOG_WARN, "Sem memória, veículo %d parado", vehicles[vehicle_idx].id);
+            return;
+        }
+        launch_retry = grown;
+        launch_retry_capacity = new_capacity;
+    }
+    launch_retry[num_launch_retry++] = vehicle_idx;
+}
+
+// --- Reserva Recuperada que Ninguém Reclamou no Prazo (chamar com clients, services e fleet) ---
+void cancel_unclaimed_service(int service_idx) {
+    log_write(LOG_INFO, "Serviço ID %d recuperado sem dono no prazo: cancelado", services[service_idx].id);
+    finish_service(service_idx, 0);
+}
+
+// --- Origem de um Serviço (sem coordenadas: a base) ---
+Position service_origin(int service_idx) {
+    const ServiceDetail* detail = &service_details[service_idx];
+    return detail->has_origin_pos ? detail->origin_pos : known_places[0].pos;
+}
+
+// --- Atribuir Veículo (já retirado da grelha) e Lançar a Viagem ---
+void assign_vehicle(int service_idx, int vehicle_idx) {
+    Position origin = service_origin(service_idx);
+    double pickup_km = distance_km(vehicles[vehicle_idx].position, origin);
+
+    long long delay_ms = sim_time_now_ms() - services[service_idx].scheduled_time * 1000LL;
+    stats_record(STAT_DISPATCH_DELAY, delay_ms > 0 ? (uint64_t)delay_ms * 1000000 : 0);
+
+    services[service_idx].vehicle_id = vehicles[vehicle_idx].id;
+    set_service_status(service_idx, STATUS_IN_PROGRESS);
+    vehicles[vehicle_idx].service_id = services[service_idx].id;
+    wal_log_event(WAL_SERVICE_DISPATCHED, services[service_idx].id, vehicles[vehicle_idx].id);
+    
+    // Atualizar cliente para em viagem
+    int c = find_client(services[service_idx].client_pid);
+    if (c != -1) {
+        set_client_status(c, CLIENT_ON_TRIP);
+    }
+
+    log_write(LOG_INFO, "Lançando veículo %d para serviço ID %d (a %.1f km da origem)",
+              vehicles[vehicle_idx].id, services[service_idx].id, pickup_km);
+
+    // A posição passa a ser a origem; no fim da viagem, o destino (se conhecido)
+    vehicles[vehicle_idx].position = origin;
+    
+    launch_vehicle(service_idx);
+}
+
+// --- Despacho em Lote (devolve o número de serviços atribuídos) ---
+// Os serviços vencidos (no máximo um por veículo livre) são atribuídos em
+// conjunto minimizando a soma das distâncias de recolha. Basta considerar,
+// para cada serviço, os n veículos mais próximos: numa solução ótima nenhum
+// serviço fica com um veículo pior do que esses (há no máximo n-1 ocupados).
+int dispatch_batch(int now) {
+    int batch[DISPATCH_BATCH_MAX];
+    int n = 0;
+    while (num_pending > 0 && pending_heap[0].scheduled_time <= now &&
+           n < DISPATCH_BATCH_MAX && n < num_free_vehicles) {
+        int i = pending_heap[0].service_idx;
+        int live = services[i].id == pending_heap[0].service_id && services[i].status == STATUS_SCHEDULED;
+        pending_pop();
+        if (live && services[i].client_pid == 0) {
+            cancel_unclaimed_service(i);
+        } else if (live) {
+            batch[n++] = i;
+        }
+    }
+    if (n <= 1) {
+        if (n == 1) assign_vehicle(batch[0], take_available_vehicle(service_origin(batch[0])));
+        return n;
+    }
+
+    // Candidatos: união dos n mais próximos de cada serviço (sem repetidos)
+    int* candidates = malloc(n * n * sizeof(int));
+    double* cost = NULL;
+    int* assignment = malloc(n * sizeof(int));
+    double nearest_dist[DISPATCH_BATCH_MAX];
+    int m = 0;
+    if (candidates != NULL) {
+        for (int r = 0; r < n; r++) {
+            m += grid_nearest(service_origin(batch[r]), n, candidates + m, nearest_dist);
+        }
+        qsort(candidates, m, sizeof(int), compare_ints);
+        int unique = 0;
+        for (int k = 0; k < m; k++) {
+            if (unique == 0 || candidates[k] != candidates[unique - 1]) {
+                candidates[unique++] = candidates[k];
+            }
+        }
+        m = unique;
+        cost = malloc((size_t)n * m * sizeof(double));
+    }
+
+    if (cost == NULL || assignment == NULL) {
+        // Sem memória: atribuição gulosa pela ordem do heap
+        for (int r = 0; r < n; r++) {
+            assign_vehicle(batch[r], take_available_vehicle(service_origin(batch[r])));
+        }
+    } else {
+        for (int r = 0; r < n; r++) {
+            Position origin = service_origin(batch[r]);
+            for (int k = 0; k < m; k++) {
+                cost[r * m + k] = distance_km(vehicles[candidates[k]].position, origin);
+            }
+        }
+
+        // Calcular tudo antes de mexer na frota: o lote é aplicado de uma vez
+        hungarian(n, m, cost, assignment);
+        double total_km = 0.0;
+        for (int r = 0; r < n; r++) {
+            int v = candidates[assignment[r]];
+            total_km += cost[r * m + assignment[r]];
+            grid_remove(v);
+            vehicles[v].available = VEHICLE_OCCUPIED;
+            assign_vehicle(batch[r], v);
+        }
+        log_write(LOG_INFO, "Lote de %d serviços (%d candidatos): %.1f km de recolha no total",
+                  n, m, total_km);
+    }
+
+    free(candidates);
+    free(cost);
+    free(assignment);
+    return n;
+}
+
+// --- Atribuição de Custo Mínimo (algoritmo húngaro com potenciais, O(n²m)) ---
+// Linhas = serviços, colunas = veículos, rows <= cols. assignment[linha] = coluna.
+int hungarian(int rows, int cols, const double* cost, int* assignment) {
+    double* u = calloc(rows + 1, sizeof(double));
+    double* v = calloc(cols + 1, sizeof(double));
+    double* min_slack = malloc((cols + 1) * sizeof(double));
+    int* match = calloc(cols + 1, sizeof(int));   // match[coluna] = linha (1-based), 0 se livre
+    int* way = malloc((cols + 1) * sizeof(int));
+    char* used = malloc(cols + 1);
+    if (u == NULL || v == NULL || min_slack == NULL || match == NULL || way == NULL || used == NULL) {
+        free(u); free(v); free(min_slack); free(match); free(way); free(used);
+        return -1;
+    }
+
+    for (int i = 1; i <= rows; i++) {
+        // Caminho de aumento a partir da coluna fictícia 0
+        match[0] = i;
+        int j0 = 0;
+        for (int j = 0; j <= cols; j++) {
+            min_slack[j] = INFINITY;
+            used[j] = 0;
+        }
+        do {
+            used[j0] = 1;
+            int i0 = match[j0], j1 = 0;
+            double delta = INFINITY;
+            for (int j = 1; j <= cols; j++) {
+                if (used[j]) continue;
+                double cur = cost[(i0 - 1) * cols + (j - 1)] - u[i0] - v[j];
+                if (cur < min_slack[j]) {
+                    min_slack[j] = cur;
+                    way[j] = j0;
+                }
+                if (min_slack[j] < delta) {
+                    delta = min_slack[j];
+                    j1 = j;
+                }
+            }
+            for (int j = 0; j <= cols; j++) {
+                if (used[j]) {
+                    u[match[j]] += delta;
+                    v[j] -= delta;
+                } else {
+                    min_slack[j] -= delta;
+                }
+            }
+            j0 = j1;
+        } while (match[j0] != 0);
+
+        // Inverter o caminho encontrado
+        do {
+            int j1 = way[j0];
+            match[j0] = match[j1];
+            j0 = j1;
+        } while (j0 != 0);
+    }
+
+    for (int j = 1; j <= cols; j++) {
+        if (match[j] != 0) assignment[match[j] - 1] = j - 1;
+    }
+    free(u); free(v); free(min_slack); free(match); free(way); free(used);
+    return 0;
+}
+
+int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// --- Fila de Serviços Pendentes (min-heap por scheduled_time, desempate por ID) ---
+int pending_before(const PendingService* a, const PendingService* b) {
+    if (a->scheduled_time != b->scheduled_time) return a->scheduled_time < b->scheduled_time;
+    return a->service_id < b->service_id;
+}
+
+void pending_push(int service_idx) {
+    pending_push_at(service_idx, services[service_idx].scheduled_time);
+}
+
+// Entrada com outra hora de vencimento (reservas recuperadas sem dono: fim do prazo)
+void pending_push_at(int service_idx, int due_time) {
+    if (num_pending == pending_capacity) {
+        int new_capacity = pending_capacity > 0 ? pending_capacity * 2 : INITIAL_SERVICES;
+        PendingService* grown = realloc(pending_heap, new_capacity * sizeof(PendingService));
+        if (grown == NULL) {
+            perror("[CONTROLADOR] Erro ao aumentar fila de serviços");
+            return;
+        }
+        pending_heap = grown;
+        pending_capacity = new_capacity;
+    }
+
+    int pos = num_pending++;
+    PendingService entry = { due_time, services[service_idx].id, service_idx };
+
+    // Subir até o pai ser anterior
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (!pending_before(&entry, &pending_heap[parent])) break;
+        pending_heap[pos] = pending_heap[parent];
+        pos = parent;
+    }
+    pending_heap[pos] = entry;
+    set_next_due_time(pending_heap[0].scheduled_time);
+}
+
+void pending_pop() {
+    if (num_pending == 0) return;
+
+    PendingService last = pending_heap[--num_pending];
+    int pos = 0;
+    if (num_pending == 0) {
+        set_next_due_time(INT_MAX);
+        return;
+    }
+
+    // Descer o último elemento a partir da raiz
+    while (1) {
+        int child = 2 * pos + 1;
+        if (child >= num_pending) break;
+        if (child + 1 < num_pending && pending_before(&pending_heap[child + 1], &pending_heap[child])) {
+            child++;
+        }
+        if (!pending_before(&pending_heap[child], &last)) break;
+        pending_heap[pos] = pending_heap[child];
+        pos = child;
+    }
+    pending_heap[pos] = last;
+    set_next_due_time(pending_heap[0].scheduled_time);
+}
+
+// --- Retirar Veículo Disponível (-1 se não houver) ---
+int take_available_vehicle(Position near) {
+    int best;
+    double best_dist;
+    if (grid_nearest(near, 1, &best, &best_dist) == 0) return -1;
+
+    grid_remove(best);
+    vehicles[best].available = VEHICLE_OCCUPIED;
+    return best;
+}
+
+// --- Os k Veículos Livres Mais Próximos (out e out_dist com k posições; devolve quantos) ---
+int grid_nearest(Position near, int k, int* out, double* out_dist) {
+    if (k > num_free_vehicles) k = num_free_vehicles;
+    if (k == 0) return 0;
+    int found = 0;
+
+    // Procurar em anéis de células à volta da origem. Qualquer célula para lá
+    // do anel r está a mais de r * GRID_CELL_KM, por isso pode-se parar
+    // quando o k-ésimo candidato está mais perto do que isso.
+    int cx = grid_coord(near.x);
+    int cy = grid_coord(near.y);
+    int r;
+    for (r = 0; (2 * r + 1) * (2 * r + 1) <= GRID_BUCKETS; r++) {
+        for (int dx = -r; dx <= r; dx++) {
+            if (dx == -r || dx == r) {
+                for (int dy = -r; dy <= r; dy++) {
+                    grid_scan_bucket(grid_bucket_of(cx + dx, cy + dy), near, k, &found, out, out_dist);
+                }
+            } else {
+                grid_scan_bucket(grid_bucket_of(cx + dx, cy - r), near, k, &found, out, out_dist);
+                grid_scan_bucket(grid_bucket_of(cx + dx, cy + r), near, k, &found, out, out_dist);
+            }
+        }
+        if (found == k && out_dist[k - 1] <= r * GRID_CELL_KM) break;
+    }
+
+    // Anéis já mais largos do que a própria tabela: percorrer todos os baldes.
+    // Células diferentes podem partilhar um balde: recomeçar evita repetidos.
+    if ((2 * r + 1) * (2 * r + 1) > GRID_BUCKETS) {
+        found = 0;
+        for (int bucket = 0; bucket < GRID_BUCKETS; bucket++) {
+            grid_scan_bucket(bucket, near, k, &found, out, out_dist);
+        }
+    }
+
+    return found;
+}
+
+// --- Candidatos de um Balde (mantém os k melhores ordenados por distância) ---
+void grid_scan_bucket(int bucket, Position near, int k, int* found, int* best, double* best_dist) {
+    GridBucket* b = &vehicle_grid[bucket];
+    for (int idx = 0; idx < b->count; idx++) {
+        int v = b->vehicles[idx];
+        double d = distance_km(vehicles[v].position, near);
+
+        // Já visto (outra célula do mesmo balde) ou pior do que os k atuais
+        int seen = 0;
+        for (int j = 0; j < *found && !seen; j++) {
+            seen = (best[j] == v);
+        }
+        if (seen) continue;
+        if (*found == k && (d > best_dist[k - 1] || (d == best_dist[k - 1] && v > best[k - 1]))) continue;
+
+        // Inserção ordenada; empate: o veículo de menor ID (resultado estável)
+        int pos = *found < k ? (*found)++ : k - 1;
+        while (pos > 0 && (best_dist[pos - 1] > d || (best_dist[pos - 1] == d && best[pos - 1] > v))) {
+            best[pos] = best[pos - 1];
+            best_dist[pos] = best_dist[pos - 1];
+            pos--;
+        }
+        best[pos] = v;
+        best_dist[pos] = d;
+    }
+}
+
+// --- Célula da Grelha (arredondamento para baixo, também para coordenadas negativas) ---
+int grid_coord(double km) {
+    double cell = km / GRID_CELL_KM;
+    int i = (int)cell;
+    return cell < i ? i - 1 : i;
+}
+
+int grid_bucket_of(int cell_x, int cell_y) {
+    uint32_t key = (uint32_t)cell_x * 73856093u ^ (uint32_t)cell_y * 19349663u;
+    return hash_int((int)key) >> (32 - GRID_BITS);  // Bits altos do hash multiplicativo
+}
+
+// --- Inserir Veículo na Grelha (-1 sem memória) ---
+int grid_insert(int vehicle_idx) {
+    int bucket = grid_bucket_of(grid_coord(vehicles[vehicle_idx].position.x),
+                                grid_coord(vehicles[vehicle_idx].position.y));
+    GridBucket* b = &vehicle_grid[bucket];
+    if (b->count == b->capacity) {
+        int new_capacity = b->capacity > 0 ? b->capacity * 2 : 4;
+        int* grown = realloc(b->vehicles, new_capacity * sizeof(int));
+        if (grown == NULL) return -1;
+        b->vehicles = grown;
+        b->capacity = new_capacity;
+    }
+    grid_refs[vehicle_idx].bucket = bucket;
+    grid_refs[vehicle_idx].slot = b->count;
+    b->vehicles[b->count++] = vehicle_idx;
+    num_free_vehicles++;
+    return 0;
+}
+
+// --- Retirar Veículo da Grelha ---
+void grid_remove(int vehicle_idx) {
+    GridRef* ref = &grid_refs[vehicle_idx];
+    if (ref->bucket == -1) return;
+
+    // O último do balde ocupa o lugar do removido
+    GridBucket* b = &vehicle_grid[ref->bucket];
+    int last = b->vehicles[--b->count];
+    b->vehicles[ref->slot] = last;
+    grid_refs[last].slot = ref->slot;
+
+    ref->bucket = -1;
+    num_free_vehicles--;
+}
+
+// --- Distância em Linha Reta ---
+double distance_km(Position a, Position b) {
+    return hypot(a.x - b.x, a.y - b.y);
+}
+
+// --- Coordenadas de um Local ("x,y" em km ou nome conhecido; 0 se desconhecido, -1 se inválido) ---
+int locate_place(const char* text, Position* pos) {
+    char tail;
+    if (sscanf(text, "%lf,%lf%c", &pos->x, &pos->y, &tail) == 2) {
+        // inf, nan ou valores enormes não cabem nas células da grelha
+        if (!isfinite(pos->x) || !isfinite(pos->y) ||
+            fabs(pos->x) >= PLACE_MAX_KM || fabs(pos->y) >= PLACE_MAX_KM) {
+            return -1;
+        }
+        return 1;
+    }
+    for (int i = 0; i < num_known_places; i++) {
+        if (strcasecmp(text, known_places[i].name) == 0 ||
+            (known_places[i].alt_name != NULL && strcasecmp(text, known_places[i].alt_name) == 0)) {
+            *pos = known_places[i].pos;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void release_vehicle(int vehicle_idx) {
+    // Pode ser chamado duas vezes (cancelamento pelo admin + telemetria CANCELLED)
+    if (vehicles[vehicle_idx].available == VEHICLE_AVAILABLE) return;
+    // Processo morto: volta à grelha quando for relançado
+    if (vehicles[vehicle_idx].process_pid == 0) return;
+
+    if (grid_insert(vehicle_idx) == -1) {
+        log_write(LOG_WARN, "Sem memória para a grelha, veículo %d parado",
+                  vehicles[vehicle_idx].id);
+        return;
+    }
+    vehicles[vehicle_idx].available = VEHICLE_AVAILABLE;
+
+    // Pode haver um serviço à espera deste veículo
+    wake_scheduler_if_due();
+}
+
+// --- Lançar Veículo (atribuir a viagem ao processo do veículo) ---
+void launch_vehicle(int service_index) {
+    ServiceInfo *srv = &services[service_index];
+    int v = find_vehicle(srv->vehicle_id);
+    if (v == -1) return;
+
+    TripAssignment trip;
+    memset(&trip, 0, sizeof(trip));
+    trip.service_id = srv->id;
+    trip.client_pid = srv->client_pid;
+    trip.distance_km = srv->distance_km;
+    snprintf(trip.origem, sizeof(trip.origem), "%s", string_of(service_details[service_index].origem_id));
+
+    if (send_vehicle_command(v, OP_VEHICLE_ASSIGN, &trip, sizeof(trip)) == -1) {
+        // O serviço volta à fila. Um processo morto fica de fora até ser recolhido e
+        // relançado; uma falha passageira (pipe cheio) devolve o veículo à grelha.
+        int dead = errno == EPIPE || kill(vehicles[v].process_pid, 0) == -1;
+        log_write(LOG_INFO, "Veículo %d não respondeu. Serviço ID %d volta à fila",
+                  srv->vehicle_id, srv->id);
+        set_service_status(service_index, STATUS_SCHEDULED);
+        srv->vehicle_id = -1;
+        vehicles[v].service_id = -1;
+        int c = find_client(srv->client_pid);
+        if (c != -1) {
+            set_client_status(c, CLIENT_WAITING);
+        }
+        pending_push(service_index);
+        if (!dead) {
+            defer_vehicle_release(v);
+        }
+        return;
+    }
+
+    vehicles[v].active = VEHICLE_ACTIVE;
+}
+
+// --- Lançar Processo do Veículo (fica à espera de viagens no stdin) ---
+int spawn_vehicle_worker(int vehicle_idx) {
+    if (telemetry_shm != NULL) {
+        // Anel vazio para o novo processo (o anterior, se existiu, já morreu)
+        TelemetryRing* ring = telemetry_shm_ring(telemetry_shm, vehicle_idx);
+        atomic_store(&ring->head, 0);
+        atomic_store(&ring->tail, 0);
+    } else if (register_vehicle_telemetry(vehicle_idx) == -1) {
+        // Abrir o pipe de telemetria para leitura antes do veículo arrancar
+        return -1;
+    }
+
+    // Pipe de comandos: o lado de leitura passa a ser o stdin do veículo.
+    // FD_CLOEXEC para os outros veículos não herdarem o lado de escrita
+    // (senão nunca veriam EOF quando o controlador termina).
+    int cmd_fds[2];
+    if (pipe(cmd_fds) == -1) {
+        perror("[CONTROLADOR] Erro ao criar pipe de comandos do veículo");
+        unregister_vehicle_telemetry(vehicle_idx);
+        return -1;
+    }
+    fcntl(cmd_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(cmd_fds[1], F_SETFD, FD_CLOEXEC);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("[CONTROLADOR] Erro ao fazer fork para veículo");
+        close(cmd_fds[0]);
+        close(cmd_fds[1]);
+        unregister_vehicle_telemetry(vehicle_idx);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Processo filho (veículo). O dup2 limpa o FD_CLOEXEC do stdin
+        dup2(cmd_fds[0], STDIN_FILENO);
+        // A máscara sobrevive ao exec: o veículo volta a receber SIGINT e SIGCHLD
+        sigset_t no_signals;
+        sigemptyset(&no_signals);
+        sigprocmask(SIG_SETMASK, &no_signals, NULL);
+
+        char arg_id[20];
+        sprintf(arg_id, "%d", vehicles[vehicle_idx].id);
+        if (telemetry_shm != NULL) {
+            char arg_event_fd[20];
+            sprintf(arg_event_fd, "%d", telemetry_event_fd);
+            execl("./veiculo", "veiculo", arg_id, telemetry_shm_name, arg_event_fd, NULL);
+        } else {
+            execl("./veiculo", "veiculo", arg_id, NULL);
+        }
+
+        perror("\r\033[K[VEICULO] Erro ao executar");
+        _exit(VEHICLE_EXEC_FAILED);
+    }
+
+    // Processo pai (controlador)
+    close(cmd_fds[0]);
+    fcntl(cmd_fds[1], F_SETFL, O_NONBLOCK);  // Um veículo bloqueado não prende o controlador
+    vehicles[vehicle_idx].command_fd = cmd_fds[1];
+    vehicles[vehicle_idx].process_pid = pid;
+    return 0;
+}
+
+// --- Enviar Comando ao Veículo (-1 com errno: EPIPE se o pipe está fechado, EAGAIN se cheio) ---
+int send_vehicle_command(int vehicle_idx, uint8_t opcode, const void* payload, size_t len) {
+    if (internal_simulation) {
+        return sim_handle_command(vehicle_idx, opcode, payload, len);
+    }
+
+    int fd = vehicles[vehicle_idx].command_fd;
+    if (fd == -1) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (frame_write(fd, opcode, 0, getpid(), payload, len) == -1) {
+        int saved_errno = errno;
+        perror("[CONTROLADOR] Erro ao enviar comando ao veículo");
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+// --- Sinal SIGCHLD: acordar a thread de telemetria ---
+void handle_sigchld(int signal) {
+    int saved_errno = errno;
+    if (telemetry_pipe_write != -1) {
+        write(telemetry_pipe_write, "c", 1);
+    }
+    errno = saved_errno;
+}
+
+// --- Recolher Veículos Terminados e Relançá-los (chamar com clients_lock, services_lock e fleet_lock) ---
+void reap_vehicle_workers() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        int v = -1;
+        for (int i = 0; i < vehicle_table.high_water; i++) {
+            if (vehicle_table.used[i] && vehicles[i].process_pid == pid) {
+                v = i;
+                break;
+            }
+        }
+        if (v == -1) continue;
+
+        vehicles[v].process_pid = 0;
+        if (vehicles[v].available == VEHICLE_AVAILABLE) {
+            // Fora da grelha até o processo ser relançado
+            grid_remove(v);
+            vehicles[v].available = VEHICLE_OCCUPIED;
+        }
+        close(vehicles[v].command_fd);
+        vehicles[v].command_fd = -1;
+        unregister_vehicle_telemetry(v);
+
+        if (!keep_running) continue;
+
+        log_write(LOG_INFO, "Processo do veículo %d terminou inesperadamente", vehicles[v].id);
+
+        // Viagem em curso termina como cancelada
+        if (vehicles[v].service_id != -1) {
+            int s = find_service(vehicles[v].service_id);
+            if (s != -1) finish_service(s, 0);
+            reset_vehicle(v);
+        }
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == VEHICLE_EXEC_FAILED) {
+            log_write(LOG_INFO, "Veículo %d fora de serviço (./veiculo não executável)", vehicles[v].id);
+            continue;
+        }
+
+        if (spawn_vehicle_worker(v) == 0) {
+            release_vehicle(v);
+        }
+    }
+}
+
+// --- Registar Pipe de Telemetria no epoll ---
+int register_vehicle_telemetry(int vehicle_idx) {
+    // Fechar o FD anterior se ainda estiver aberto
+    unregister_vehicle_telemetry(vehicle_idx);
+
+    char pipe_path[50];
+    sprintf(pipe_path, PIPE_VEHICLE_FMT, vehicles[vehicle_idx].id);
+
+    // O_NONBLOCK: a abertura não espera pelo escritor (o veículo ainda não existe)
+    int fd = open(pipe_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        perror("[CONTROLADOR] Erro ao abrir pipe de veículo");
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = vehicle_idx;
+    if (epoll_ctl(telemetry_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("[CONTROLADOR] Erro ao registar pipe de veículo");
+        close(fd);
+        return -1;
+    }
+
+    vehicles[vehicle_idx].telemetry_fd = fd;
+    return 0;
+}
+
+// --- Remover Pipe de Telemetria do epoll ---
+void unregister_vehicle_telemetry(int vehicle_idx) {
+    int fd = vehicles[vehicle_idx].telemetry_fd;
+    if (fd == -1) return;
+
+    epoll_ctl(telemetry_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    vehicles[vehicle_idx].telemetry_fd = -1;
+}
+
+// --- Thread de Telemetria de Veículos ---
+void* vehicle_telemetry_thread(void* arg) {
+    char buffer[BUFFER_SIZE];
+    TelemetryRecord records[TELEMETRY_BATCH];
+    struct epoll_event events[TELEMETRY_MAX_EVENTS];
+
+    // SIGCHLD está bloqueado nas outras threads (ver main)
+    sigset_t chld_set;
+    sigemptyset(&chld_set);
+    sigaddset(&chld_set, SIGCHLD);
+    pthread_sigmask(SIG_UNBLOCK, &chld_set, NULL);
+    
+    while (keep_running) {
+        // Bloquear até haver dados em algum pipe (sem polling)
+        int n_events = epoll_wait(telemetry_epoll_fd, events, TELEMETRY_MAX_EVENTS, -1);
+        if (n_events == -1) {
+            if (errno == EINTR) continue;
+            perror("[CONTROLADOR] Erro no epoll de telemetria");
+            break;
+        }
+
+        for (int e = 0; e < n_events; e++) {
+            if (events[e].data.u32 == TELEMETRY_WAKE_TAG) {
+                // Pedido para acordar (encerramento, SIGCHLD ou cliente morto)
+                while (read(telemetry_pipe_read, buffer, sizeof(buffer)) > 0);
+                reap_pending = 1;
+                continue;
+            }
+
+            if (events[e].data.u32 == TELEMETRY_SHM_TAG) {
+                // Algum veículo escreveu no seu anel
+                uint64_t count;
+                read(telemetry_event_fd, &count, sizeof(count));
+                drain_telemetry_rings();
+                continue;
+            }
+
+            if (events[e].data.u32 & CLIENT_CONN_TAG) {
+                // Pipe de cliente com espaço: escrever respostas em fila
+                pthread_mutex_lock(&conn_mutex);
+                ClientConnection* conn = &client_conns[events[e].data.u32 & ~CLIENT_CONN_TAG];
+                if (conn->pid != 0 && conn->count > 0 && flush_client_connection(conn) == -1) {
+                    mark_client_dead(conn->pid);
+                }
+                pthread_mutex_unlock(&conn_mutex);
+                continue;
+            }
+
+            int i = events[e].data.u32;
+            int fd = vehicles[i].telemetry_fd;
+            if (fd == -1) continue;  // Já removido por um evento anterior
+
+            // Cada registo foi escrito com um write() atómico: pedindo um múltiplo
+            // do tamanho do registo, o read() devolve sempre registos inteiros
+            ssize_t n = read(fd, records, sizeof(records));
+            if (n > 0) {
+                int count = n / sizeof(TelemetryRecord);
+                for (int r = 0; r < count; r++) {
+                    process_vehicle_telemetry(&records[r]);
+                }
+            } else if (n == 0 || errno != EAGAIN) {
+                // Veículo fechou o pipe sem reportar conclusão
+                timed_wrlock(&fleet_lock);
+                unregister_vehicle_telemetry(i);
+                timed_unlock(&fleet_lock);
+            }
+        }
+
+        // Só depois do lote: um veículo relançado reutiliza o índice e os
+        // eventos restantes do lote ainda se referem ao pipe antigo
+        if (reap_pending) {
+            reap_pending = 0;
+            timed_rdlock(&clients_lock);
+            timed_wrlock(&services_lock);
+            timed_wrlock(&fleet_lock);
+            reap_vehicle_workers();
+            timed_unlock(&fleet_lock);
+            timed_unlock(&services_lock);
+            timed_unlock(&clients_lock);
+            reap_dead_clients();
+        }
+    }
+    
+    // Fechar todos os file descriptors ao terminar
+    timed_wrlock(&fleet_lock);
+    for (int i = 0; i < vehicle_table.high_water; i++) {
+        unregister_vehicle_telemetry(i);
+    }
+    timed_unlock(&fleet_lock);
+    
+    return NULL;
+}
+
+// --- Criar Memória Partilhada de Telemetria (um anel por slot de veículo) ---
+void telemetry_shm_init(int num_rings) {
+    snprintf(telemetry_shm_name, sizeof(telemetry_shm_name), SHM_TELEMETRY_FMT, getpid());
+    int fd = shm_open(telemetry_shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("[CONTROLADOR] Erro ao criar memória partilhada de telemetria");
+        exit(1);
+    }
+
+    // ftruncate preenche com zeros: anéis vazios e bitmap limpo
+    telemetry_shm_bytes = telemetry_shm_size(num_rings);
+    if (ftruncate(fd, telemetry_shm_bytes) == -1) {
+        perror("[CONTROLADOR] Erro ao dimensionar memória partilhada de telemetria");
+        shm_unlink(telemetry_shm_name);
+        exit(1);
+    }
+    telemetry_shm = mmap(NULL, telemetry_shm_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (telemetry_shm == MAP_FAILED) {
+        perror("[CONTROLADOR] Erro ao mapear memória partilhada de telemetria");
+        shm_unlink(telemetry_shm_name);
+        exit(1);
+    }
+    ((TelemetryShmHeader*)telemetry_shm)->num_rings = num_rings;
+
+    // Sem FD_CLOEXEC: os veículos herdam o eventfd (recebem o número por argumento)
+    telemetry_event_fd = eventfd(0, EFD_NONBLOCK);
+    if (telemetry_event_fd == -1) {
+        perror("[CONTROLADOR] Erro ao criar eventfd de telemetria");
+        shm_unlink(telemetry_shm_name);
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = TELEMETRY_SHM_TAG;
+    if (epoll_ctl(telemetry_epoll_fd, EPOLL_CTL_ADD, telemetry_event_fd, &ev) == -1) {
+        perror("[CONTROLADOR] Erro ao registar eventfd de telemetria");
+        shm_unlink(telemetry_shm_name);
+        exit(1);
+    }
+
+    printf("[CONTROLADOR] Telemetria por memória partilhada (%s, %zu bytes).\n",
+           telemetry_shm_name, telemetry_shm_bytes);
+}
+
+// --- Drenar Anéis Marcados (só a thread de telemetria consome) ---
+void drain_telemetry_rings() {
+    uint32_t num_rings = ((TelemetryShmHeader*)telemetry_shm)->num_rings;
+    _Atomic uint64_t* dirty = telemetry_shm_dirty(telemetry_shm);
+
+    for (uint32_t w = 0; w < (num_rings + 63) / 64; w++) {
+        // Limpar a palavra antes de ler os anéis: um registo escrito depois
+        // encontra o bit limpo e volta a acordar esta thread
+        uint64_t bits = atomic_exchange(&dirty[w], 0);
+        while (bits != 0) {
+            uint32_t ring_idx = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            TelemetryRing* ring = telemetry_shm_ring(telemetry_shm, ring_idx);
+            uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            while (tail != head) {
+                // Processado no próprio anel, sem cópia
+                process_vehicle_telemetry(&ring->records[tail % TELEMETRY_RING_SIZE]);
+                tail++;
+                atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            }
+        }
+    }
+}
+
+// --- Processar Telemetria do Veículo ---
+void process_vehicle_telemetry(const TelemetryRecord* rec) {
+    wal_last_lsn = 0;
+    int vid = rec->vehicle_id;
+    int service_id = rec->service_id;
+    stats_count(STAT_TELEMETRY_RECORDS, 1);
+
+    if (rec->event == TELEMETRY_TRIP_STARTED) {
+        // Enviar mensagem ao cliente que a viagem iniciou
+        timed_rdlock(&services_lock);
+        int s = find_service(service_id);
+        if (s != -1 && services[s].status == STATUS_IN_PROGRESS) {
+            send_response(services[s].client_pid, 1, "Viagem iniciada!");
+            log_write(LOG_INFO, "Viagem iniciada!");
+        }
+        timed_unlock(&services_lock);
+    } else if (rec->event == TELEMETRY_PROGRESS) {
+        // Progresso e distância só precisam da frota em leitura (escrita atómica
+        // dos campos): correm em paralelo com frota/km e entre veículos
+        double km = rec->km, prev_km;
+        int updated = 0;
+        timed_rdlock(&fleet_lock);
+        int v = find_vehicle(vid);
+        // Ignorar telemetria de uma viagem já cancelada pelo controlador
+        if (v != -1 && vehicles[v].service_id == service_id) {
+            int prev_percent = __atomic_exchange_n(&vehicles[v].progress_percent, rec->percent, __ATOMIC_RELAXED);
+            __atomic_exchange(&vehicles[v].total_km, &km, &prev_km, __ATOMIC_RELAXED);
+            // Ponto de retoma depois de uma falha, no máximo um por degrau (entra no
+            // próximo lote do log). Registado depois de guardado no veículo (ver wal_snapshot)
+            if (rec->percent / WAL_PROGRESS_STEP > prev_percent / WAL_PROGRESS_STEP) {
+                wal_log_event(WAL_SERVICE_PROGRESS, service_id, rec->percent);
+            }
+            updated = 1;
+        }
+        timed_unlock(&fleet_lock);
+
+        if (updated) {
+            log_write(LOG_DEBUG, "Veículo %d percorreu mais %.1f km. Total: %.1f km",
+                      vid, rec->km - prev_km, rec->km);
+        }
+    } else if (rec->event == TELEMETRY_COMPLETED || rec->event == TELEMETRY_CANCELLED) {
+        timed_rdlock(&clients_lock);
+        timed_wrlock(&services_lock);
+        timed_wrlock(&fleet_lock);
+
+        // O veículo continua vivo à espera da próxima viagem, onde deixou o cliente
+        int i = find_service(service_id);
+        int v = find_vehicle(vid);
+        int owns_vehicle = (v != -1 && vehicles[v].service_id == service_id);
+        if (owns_vehicle && i != -1 && rec->event == TELEMETRY_COMPLETED && service_details[i].has_dest_pos) {
+            vehicles[v].position = service_details[i].dest_pos;
+        }
+
+        // Serviços já cancelados pelo admin já saíram da tabela
+        if (i != -1 && services[i].status == STATUS_IN_PROGRESS) {
+            finish_service(i, rec->event == TELEMETRY_COMPLETED);
+        }
+        if (owns_vehicle) {
+            reset_vehicle(v);
+        }
+
+        timed_unlock(&fleet_lock);
+        timed_unlock(&services_lock);
+        timed_unlock(&clients_lock);
+    }
+}
+
+// --- Terminar Serviço, Avisar o Cliente e Arquivá-lo (chamar com clients_lock, services_lock e fleet_lock) ---
+void finish_service(int service_idx, int completed) {
+    int progress = completed ? 100 : service_progress(service_idx);
+    set_service_status(service_idx, completed ? STATUS_COMPLETED : STATUS_CANCELLED);
+
+    char msg[BUFFER_SIZE];
+    if (completed) {
+        sprintf(msg, "Viagem concluída! Percorridos %.1f km.", services[service_idx].distance_km);
+    } else {
+        sprintf(msg, "Viagem cancelada. Serviço ID %d", services[service_idx].id);
+    }
+    int c = find_client(services[service_idx].client_pid);
+
+    // Antes da resposta: ela espera pelo registo terminal no log
+    retire_service(service_idx, progress);
+
+    if (c != -1) {
+        set_client_status(c, CLIENT_WAITING);
+        send_response(clients[c].pid, 1, msg);
+    }
+}
+
+// --- Libertar Veículo no Fim da Viagem (chamar com fleet_lock em escrita) ---
+void reset_vehicle(int vehicle_idx) {
+    vehicles[vehicle_idx].active = VEHICLE_INACTIVE;
+    vehicles[vehicle_idx].progress_percent = 0;
+    vehicles[vehicle_idx].service_id = -1;
+    vehicles[vehicle_idx].total_km = 0.0;  // Resetar KM para a próxima viagem
+    release_vehicle(vehicle_idx);
+}
+
+// --- Simulação Interna: Arranque da Roda e da Pool ---
+void sim_init() {
+    sim_num_trips = vehicle_table.high_water;
+    sim_trips = calloc(sim_num_trips > 0 ? sim_num_trips : 1, sizeof(SimTrip));
+    if (sim_trips == NULL) {
+        perror("[CONTROLADOR] Erro ao alocar simulação interna");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &sim_epoch);
+
+    int num_threads = SIM_DEFAULT_THREADS;
+    if (getenv("SIM_THREADS") != NULL && atoi(getenv("SIM_THREADS")) > 0) {
+        num_threads = atoi(getenv("SIM_THREADS"));
+    }
+
+    pthread_t t_sim;
+    if (pthread_create(&t_sim, NULL, sim_wheel_thread, NULL) != 0) {
+        perror("[CONTROLADOR] Erro thread roda de timers");
+        exit(1);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&t_sim, NULL, sim_worker_thread, NULL) != 0) {
+            perror("[CONTROLADOR] Erro thread simulação");
+            exit(1);
+        }
+    }
+    printf("[CONTROLADOR] Simulação interna: %d veículos em %d threads.\n", sim_num_trips, num_threads);
+}
+
+// --- Tick Atual da Roda (desde o arranque) ---
+long sim_now_tick() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (now.tv_sec - sim_epoch.tv_sec) * 1000 + (now.tv_nsec - sim_epoch.tv_nsec) / 1000000;
+    return ms / SIM_TICK_MS;
+}
+
+// --- Agendar o Próximo Passo de um Veículo (chamar com sim_mutex) ---
+void sim_schedule(int vehicle_idx, int delay_ms) {
+    // Roda parada: retoma a contagem a partir de agora
+    if (sim_num_timers == 0) {
+        sim_tick = sim_now_tick();
+    }
+
+    SimTimer timer;
+    timer.vehicle_idx = vehicle_idx;
+    timer.generation = sim_trips[vehicle_idx].generation;
+    timer.expires_tick = sim_now_tick() + (delay_ms + SIM_TICK_MS - 1) / SIM_TICK_MS;
+    if (timer.expires_tick <= sim_tick) {
+        timer.expires_tick = sim_tick + 1;
+    }
+
+    SimWheelSlot* slot = &sim_wheel[timer.expires_tick % SIM_WHEEL_SLOTS];
+    if (slot->count == slot->capacity) {
+        int new_capacity = slot->capacity > 0 ? slot->capacity * 2 : 16;
+        SimTimer* grown = realloc(slot->timers, new_capacity * sizeof(SimTimer));
+        if (grown == NULL) {
+            perror("[CONTROLADOR] Erro ao aumentar roda de timers");
+            return;
+        }
+        slot->timers = grown;
+        slot->capacity = new_capacity;
+    }
+    slot->timers[slot->count++] = timer;
+
+    if (sim_num_timers++ == 0) {
+        pthread_cond_signal(&sim_wheel_cond);
+    }
+}
+
+// --- Entregar Timer Vencido à Pool (chamar com sim_mutex) ---
+void sim_ready_push(SimTimer timer) {
+    if (sim_ready_count == sim_ready_capacity) {
+        int new_capacity = sim_ready_capacity > 0 ? sim_ready_capacity * 2 : 64;
+        SimTimer* grown = malloc(new_capacity * sizeof(SimTimer));
+        if (grown == NULL) {
+            perror("[CONTROLADOR] Erro ao aumentar fila da simulação");
+            return;
+        }
+        // Desenrolar a fila circular para o início do novo array
+        for (int i = 0; i < sim_ready_count; i++) {
+            grown[i] = sim_ready[(sim_ready_head + i) % sim_ready_capacity];
+        }
+        free(sim_ready);
+        sim_ready = grown;
+        sim_ready_head = 0;
+        sim_ready_capacity = new_capacity;
+    }
+
+    sim_ready[(sim_ready_head + sim_ready_count) % sim_ready_capacity] = timer;
+    sim_ready_count++;
+    pthread_cond_signal(&sim_ready_cond);
+}
+
+// --- Thread da Roda de Timers ---
+void* sim_wheel_thread(void* arg) {
+    pthread_mutex_lock(&sim_mutex);
+    while (keep_running) {
+        if (sim_num_timers == 0) {
+            // Nenhum veículo em viagem: dormir até haver um timer
+            pthread_cond_wait(&sim_wheel_cond, &sim_mutex);
+            continue;
+        }
+
+        // Processar todos os ticks que já passaram
+        long now = sim_now_tick();
+        while (sim_tick < now) {
+            sim_tick++;
+            SimWheelSlot* slot = &sim_wheel[sim_tick % SIM_WHEEL_SLOTS];
+            int kept = 0;
+            for (int i = 0; i < slot->count; i++) {
+                SimTimer timer = slot->timers[i];
+                if (timer.expires_tick > sim_tick) {
+                    slot->timers[kept++] = timer;  // Vence numa das próximas voltas
+                    continue;
+                }
+                sim_num_timers--;
+                if (timer.generation == sim_trips[timer.vehicle_idx].generation) {
+                    sim_ready_push(timer);
+                }
+            }
+            slot->count = kept;
+        }
+
+        // Dormir até ao início do próximo tick
+        long next_ms = (sim_tick + 1) * SIM_TICK_MS;
+        struct timespec next = sim_epoch;
+        next.tv_sec += next_ms / 1000;
+        next.tv_nsec += (next_ms % 1000) * 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_unlock(&sim_mutex);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        pthread_mutex_lock(&sim_mutex);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return NULL;
+}
+
+// --- Thread da Pool de Simulação ---
+void* sim_worker_thread(void* arg) {
+    pthread_mutex_lock(&sim_mutex);
+    while (keep_running) {
+        if (sim_ready_count == 0) {
+            pthread_cond_wait(&sim_ready_cond, &sim_mutex);
+            continue;
+        }
+
+        SimTimer timer = sim_ready[sim_ready_head];
+        sim_ready_head = (sim_ready_head + 1) % sim_ready_capacity;
+        sim_ready_count--;
+
+        pthread_mutex_unlock(&sim_mutex);
+        sim_step(timer.vehicle_idx, timer.generation);
+        pthread_mutex_lock(&sim_mutex);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return NULL;
+}
+
+// --- Executar um Passo da Viagem Simulada ---
+void sim_step(int vehicle_idx, unsigned generation) {
+    // O evento é montado com sim_mutex e emitido depois de o largar:
+    // process_vehicle_telemetry pede os locks de dados
+    TelemetryRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    char contact[BUFFER_SIZE];
+    int contact_pid = 0;
+
+    pthread_mutex_lock(&sim_mutex);
+    SimTrip* trip = &sim_trips[vehicle_idx];
+    if (!trip->active || trip->generation != generation) {
+        pthread_mutex_unlock(&sim_mutex);
+        return;
+    }
+
+    if (trip->percent < 0) {
+        // Chegou ao local de partida: avisar o cliente e iniciar a viagem
+        trip->percent = 0;
+        contact_pid = trip->client_pid;
+        snprintf(contact, sizeof(contact), "Veículo %d chegou a '%s'. A viagem está a iniciar!",
+                 trip->vehicle_id, trip->origem);
+        rec.event = TELEMETRY_TRIP_STARTED;
+    } else {
+        // Como no processo veiculo: o último passo vai só no COMPLETED
+        trip->percent += 10;
+        rec.event = trip->percent >= 100 ? TELEMETRY_COMPLETED : TELEMETRY_PROGRESS;
+        rec.percent = trip->percent;
+        rec.km = (trip->percent / 100.0) * trip->distance_km;
+        if (trip->percent >= 100) {
+            trip->active = 0;
+        }
+    }
+    rec.vehicle_id = trip->vehicle_id;
+    rec.service_id = trip->service_id;
+    pthread_mutex_unlock(&sim_mutex);
+
+    if (contact_pid != 0) {
+        send_response(contact_pid, 1, contact);
+    }
+    process_vehicle_telemetry(&rec);
+
+    // Agendar o passo seguinte se a viagem não foi cancelada entretanto
+    pthread_mutex_lock(&sim_mutex);
+    if (trip->active && trip->generation == generation) {
+        sim_schedule(vehicle_idx, trip->step_ms);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+// --- Comando para um Veículo Simulado (chamar com fleet_lock em escrita) ---
+int sim_handle_command(int vehicle_idx, uint8_t opcode, const void* payload, size_t len) {
+    if (vehicle_idx >= sim_num_trips) {
+        errno = EPIPE;  // Sem slot de simulação: o veículo não pode ser usado
+        return -1;
+    }
+
+    pthread_mutex_lock(&sim_mutex);
+    SimTrip* trip = &sim_trips[vehicle_idx];
+
+    if (opcode == OP_VEHICLE_ASSIGN && len == sizeof(TripAssignment)) {
+        const TripAssignment* assignment = payload;
+        trip->generation++;
+        trip->active = 1;
+        trip->vehicle_id = vehicles[vehicle_idx].id;
+        trip->service_id = assignment->service_id;
+        trip->client_pid = assignment->client_pid;
+        trip->distance_km = assignment->distance_km;
+        snprintf(trip->origem, sizeof(trip->origem), "%s", assignment->origem);
+        trip->percent = -1;
+        // Ao milissegundo e à velocidade do relógio simulado (1 km por segundo simulado)
+        trip->step_ms = (int)(assignment->distance_km / 10.0 * 1000 / time_speed);
+        sim_schedule(vehicle_idx, 0);
+    } else if (opcode == OP_VEHICLE_CANCEL && len == sizeof(int32_t)) {
+        int32_t target;
+        memcpy(&target, payload, sizeof(target));
+        if (trip->active && trip->service_id == target) {
+            trip->active = 0;
+            trip->generation++;
+        }
+    }
+
+    pthread_mutex_unlock(&sim_mutex);
+    return 0;
+}
+
+// --- Relógio Simulado (derivado do relógio monotónico, sem estado partilhado) ---
+long long sim_time_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double real_ms = (now.tv_sec - sim_clock_start.tv_sec) * 1000.0 +
+                     (now.tv_nsec - sim_clock_start.tv_nsec) / 1000000.0;
+    return (long long)(real_ms * time_speed);
+}
+
+int sim_time_now() {
+    return (int)(sim_time_now_ms() / 1000);
+}
+
+// --- Atualizar o Topo do Heap (chamar com services_lock em escrita) ---
+void set_next_due_time(int due) {
+    if (atomic_exchange(&next_due_time, due) == due) return;
+
+    // A thread do relógio pode estar à espera de um prazo que já não é o próximo
+    pthread_mutex_lock(&clock_mutex);
+    pthread_cond_signal(&clock_cond);
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+// --- Thread de Simulação de Tempo ---
+// Já não conta segundos: dorme até ao instante real em que o próximo serviço
+// vence (ou até o topo do heap mudar) e acorda o scheduler.
+void* time_simulator_thread(void* arg) {
+    pthread_mutex_lock(&clock_mutex);
+    while (keep_running) {
+        int due = atomic_load(&next_due_time);
+
+        if (due == INT_MAX) {
+            pthread_cond_wait(&clock_cond, &clock_mutex);
+            continue;
+        }
+
+        if (due <= sim_time_now()) {
+            // Vencido: o scheduler despacha ou espera por um veículo (release_vehicle
+            // acorda-o); aqui só se espera que o topo do heap mude
+            pthread_mutex_unlock(&clock_mutex);
+            wake_scheduler_if_due();
+            pthread_mutex_lock(&clock_mutex);
+            if (atomic_load(&next_due_time) == due) {
+                pthread_cond_wait(&clock_cond, &clock_mutex);
+            }
+            continue;
+        }
+
+        // Instante real em que o relógio simulado chega a 'due'
+        double real_ms = due * 1000.0 / time_speed;
+        long long whole_ms = (long long)real_ms + 1;
+        struct timespec deadline = sim_clock_start;
+        deadline.tv_sec += whole_ms / 1000;
+        deadline.tv_nsec += (whole_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&clock_cond, &clock_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&clock_mutex);
+    return NULL;
+}
+
+// --- Persistência: Arranque (recupera o estado e lança a thread do log) ---
+// Com DIR_ESTADO definido, as reservas sobrevivem a um reinício do controlador.
+// O log só cresce até WAL_SNAPSHOT_BYTES: aí grava-se um snapshot dos serviços
+// por terminar e o log recomeça vazio, por isso a recuperação é limitada.
+void wal_init() {
+    const char* dir = getenv("DIR_ESTADO");
+    if (dir == NULL || dir[0] == '\0') return;
+
+    if (strlen(dir) >= sizeof(state_dir)) {
+        fprintf(stderr, "[CONTROLADOR] Erro: DIR_ESTADO demasiado longo (máximo %zu caracteres)\n",
+                sizeof(state_dir) - 1);
+        exit(1);
+    }
+    snprintf(state_dir, sizeof(state_dir), "%s", dir);
+    if (mkdir(state_dir, 0755) == -1 && errno != EEXIST) {
+        perror("[CONTROLADOR] Erro ao criar diretório de estado");
+        exit(1);
+    }
+
+    char path[PATH_MAX];
+    state_path(path, sizeof(path), WAL_FILE);
+    wal_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (wal_fd == -1) {
+        perror("[CONTROLADOR] Erro ao abrir log de estado");
+        exit(1);
+    }
+
+    wal_recover();
+
+    // O estado recuperado passa a ser o snapshot e o log recomeça vazio
+    if (wal_snapshot() == -1) {
+        perror("[CONTROLADOR] Erro ao gravar snapshot");
+        exit(1);
+    }
+
+    pthread_t t_wal;
+    if (pthread_create(&t_wal, NULL, wal_thread, NULL) != 0) {
+        perror("[CONTROLADOR] Erro thread do log");
+        exit(1);
+    }
+    printf("[CONTROLADOR] Estado persistido em %s.\n", state_dir);
+}
+
+// --- Recuperar Estado: Snapshot e depois os Registos Posteriores do Log ---
+void wal_recover() {
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    uint64_t snapshot_lsn = 0;
+    long long time_ms = 0;
+    int from_snapshot = wal_load_snapshot(&snapshot_lsn, &time_ms);
+    if (snapshot_lsn > wal_next_lsn) wal_next_lsn = snapshot_lsn;
+
+    struct stat st;
+    int replayed = 0;
+    if (fstat(wal_fd, &st) == 0 && st.st_size > 0) {
+        size_t size = st.st_size;
+        char* log = malloc(size);
+        if (log == NULL || lseek(wal_fd, 0, SEEK_SET) == -1 || read_full(wal_fd, log, size) != (ssize_t)size) {
+            perror("[CONTROLADOR] Erro ao ler log de estado");
+            exit(1);
+        }
+
+        size_t offset = 0;
+        while (size - offset >= sizeof(WalHeader)) {
+            WalHeader hdr;
+            memcpy(&hdr, log + offset, sizeof(WalHeader));
+            const char* payload = log + offset + sizeof(WalHeader);
+            if (hdr.magic != WAL_MAGIC || hdr.length > size - offset - sizeof(WalHeader) ||
+                wal_checksum(&hdr, payload, hdr.length) != hdr.checksum) {
+                break;  // Registo cortado a meio por uma falha: o log acaba aqui
+            }
+            offset += sizeof(WalHeader) + hdr.length;
+
+            if (hdr.sim_time_ms > time_ms) time_ms = hdr.sim_time_ms;
+            if (hdr.lsn < snapshot_lsn) continue;  // Já incluído no snapshot
+            wal_apply(&hdr, payload);
+            if (hdr.lsn >= wal_next_lsn) wal_next_lsn = hdr.lsn + 1;
+            replayed++;
+        }
+        if (offset < size) {
+            printf("[CONTROLADOR] AVISO: Fim do log incompleto, %zu bytes descartados.\n", size - offset);
+        }
+        free(log);
+    }
+
+    // Os veículos não sobrevivem ao reinício: as viagens em curso voltam à fila
+    // com a distância que faltava percorrer. Os PIDs guardados já não têm
+    // sessão: as reservas ficam sem dono (client_pid 0) e só são despachadas
+    // depois de o cliente voltar (rebind_client_services). As que ninguém
+    // reclamar são canceladas RECOVERY_GRACE_S depois da hora marcada (e nunca
+    // antes de passar esse prazo desde o arranque).
+    int pending = 0, resumed = 0;
+    int grace_until = (int)(time_ms / 1000) + RECOVERY_GRACE_S;
+    for (int s = 0; s < service_table.high_water; s++) {
+        if (!service_table.used[s]) continue;
+        if (services[s].status == STATUS_IN_PROGRESS) {
+            int percent = s < recovered_progress_capacity ? recovered_progress[s] : 0;
+            services[s].distance_km *= (100 - percent) / 100.0;
+            set_service_status(s, STATUS_SCHEDULED);
+            services[s].vehicle_id = -1;
+            resumed++;
+        }
+        if (services[s].status == STATUS_SCHEDULED) {
+            services[s].client_pid = 0;
+            int due = services[s].scheduled_time + RECOVERY_GRACE_S;
+            pending_push_at(s, due > grace_until ? due : grace_until);
+            pending++;
+        }
+    }
+    free(recovered_progress);
+    recovered_progress = NULL;
+    recovered_progress_capacity = 0;
+    wal_durable_lsn = wal_next_lsn - 1;
+
+    // O relógio simulado continua onde parou
+    long long offset_ms = (long long)(time_ms / time_speed);
+    sim_clock_start.tv_sec -= offset_ms / 1000;
+    sim_clock_start.tv_nsec -= (offset_ms % 1000) * 1000000;
+    if (sim_clock_start.tv_nsec < 0) {
+        sim_clock_start.tv_sec--;
+        sim_clock_start.tv_nsec += 1000000000;
+    }
+
+    if (from_snapshot == 0 && replayed == 0) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double elapsed_ms = (finished.tv_sec - started.tv_sec) * 1000.0 +
+                        (finished.tv_nsec - started.tv_nsec) / 1000000.0;
+    printf("[CONTROLADOR] Estado recuperado em %.1f ms: %d serviço(s) por terminar "
+           "(%d do snapshot, %d registo(s) do log), relógio em %lld s.\n",
+           elapsed_ms, pending, from_snapshot, replayed, time_ms / 1000);
+    if (resumed > 0) {
+        printf("[CONTROLADOR] %d viagem(ns) interrompida(s) voltam à fila.\n", resumed);
+    }
+}
+
+// --- Ler Snapshot (devolve o número de serviços carregados; 0 se não existe) ---
+int wal_load_snapshot(uint64_t* lsn, long long* time_ms) {
+    char path[PATH_MAX];
+    state_path(path, sizeof(path), SNAPSHOT_FILE);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+
+    // O snapshot é substituído com rename: se não for válido, o log não chega
+    // para reconstruir o estado e é melhor não arrancar do que perder reservas
+    struct stat st;
+    char* data = NULL;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(SnapshotHeader) ||
+        (data = malloc(st.st_size)) == NULL || read_full(fd, data, st.st_size) != st.st_size) {
+        perror("[CONTROLADOR] Erro ao ler snapshot");
+        exit(1);
+    }
+    close(fd);
+
+    SnapshotHeader hdr;
+    memcpy(&hdr, data, sizeof(SnapshotHeader));
+    size_t covered = st.st_size - offsetof(SnapshotHeader, lsn);
+    if (hdr.magic != SNAPSHOT_MAGIC || hdr.count < 0 ||
+        (size_t)st.st_size != sizeof(SnapshotHeader) + (size_t)hdr.count * sizeof(ServiceRecord) ||
+        fnv1a_update(2166136261u, data + offsetof(SnapshotHeader, lsn), covered) != hdr.checksum) {
+        fprintf(stderr, "[CONTROLADOR] Erro: Snapshot %s inválido\n", path);
+        exit(1);
+    }
+
+    for (int i = 0; i < hdr.count; i++) {
+        ServiceRecord rec;
+        memcpy(&rec, data + sizeof(SnapshotHeader) + i * sizeof(ServiceRecord), sizeof(ServiceRecord));
+        int s = service_from_record(&rec);
+        if (s != -1 && rec.status == STATUS_IN_PROGRESS) {
+            set_recovered_progress(s, rec.progress_percent);
+        }
+    }
+    free(data);
+
+    if (hdr.next_service_id > next_service_id) next_service_id = hdr.next_service_id;
+    *lsn = hdr.lsn;
+    *time_ms = hdr.sim_time_ms;
+    return hdr.count;
+}
+
+// --- Aplicar um Registo do Log (recuperação, antes de haver threads) ---
+void wal_apply(const WalHeader* hdr, const char* payload) {
+    if (hdr->type == WAL_SERVICE_BOOKED) {
+        if (hdr->length != sizeof(ServiceRecord)) return;
+        ServiceRecord rec;
+        memcpy(&rec, payload, sizeof(ServiceRecord));
+        service_from_record(&rec);
+        return;
+    }
+
+    if (hdr->length != sizeof(WalServiceEvent)) return;
+    WalServiceEvent ev;
+    memcpy(&ev, payload, sizeof(WalServiceEvent));
+    int s = find_service(ev.service_id);
+    if (s == -1) return;
+
+    switch (hdr->type) {
+        case WAL_SERVICE_DISPATCHED:
+            set_service_status(s, STATUS_IN_PROGRESS);
+            services[s].vehicle_id = ev.value;
+            set_recovered_progress(s, 0);
+            break;
+        case WAL_SERVICE_PROGRESS:
+            if (services[s].status == STATUS_IN_PROGRESS) {
+                set_recovered_progress(s, ev.value);
+            }
+            break;
+        case WAL_SERVICE_COMPLETED:
+        case WAL_SERVICE_CANCELLED:
+            // Já foi para o arquivo quando terminou
+            drop_service(s);
+            break;
+        default:
+            break;
+    }
+}
+
+void set_recovered_progress(int service_idx, int percent) {
+    if (service_idx >= recovered_progress_capacity) {
+        int new_capacity = service_table.capacity;
+        int* grown = realloc(recovered_progress, new_capacity * sizeof(int));
+        if (grown == NULL) return;
+        memset(grown + recovered_progress_capacity, 0, (new_capacity - recovered_progress_capacity) * sizeof(int));
+        recovered_progress = grown;
+        recovered_progress_capacity = new_capacity;
+    }
+    recovered_progress[service_idx] = percent;
+}
+
+// --- Serviço <-> Registo em Disco ---
+void service_to_record(int service_idx, int progress_percent, ServiceRecord* rec) {
+    ServiceInfo* srv = &services[service_idx];
+    memset(rec, 0, sizeof(ServiceRecord));
+    rec->id = srv->id;
+    rec->client_pid = srv->client_pid;
+    rec->scheduled_time = srv->scheduled_time;
+    rec->vehicle_id = srv->vehicle_id;
+    rec->status = srv->status;
+    rec->progress_percent = progress_percent;
+    rec->distance_km = srv->distance_km;
+    const ServiceDetail* detail = &service_details[service_idx];
+    snprintf(rec->client_name, sizeof(rec->client_name), "%s", string_of(detail->client_name_id));
+    snprintf(rec->origem, sizeof(rec->origem), "%s", string_of(detail->origem_id));
+    snprintf(rec->destino, sizeof(rec->destino), "%s", string_of(detail->destino_id));
+}
+
+// Devolve o handle do serviço criado (-1 se já existe ou sem memória)
+int service_from_record(const ServiceRecord* rec) {
+    if (find_service(rec->id) != -1) return -1;
+    int s = slab_alloc(&service_table);
+    if (s == -1) return -1;
+
+    // Os textos no disco podem não ter terminador
+    char client_name[sizeof(rec->client_name)];
+    char origem[sizeof(rec->origem)];
+    char destino[sizeof(rec->destino)];
+    snprintf(client_name, sizeof(client_name), "%.*s", (int)sizeof(client_name) - 1, rec->client_name);
+    snprintf(origem, sizeof(origem), "%.*s", (int)sizeof(origem) - 1, rec->origem);
+    snprintf(destino, sizeof(destino), "%.*s", (int)sizeof(destino) - 1, rec->destino);
+
+    services[s].id = rec->id;
+    services[s].client_pid = rec->client_pid;
+    services[s].scheduled_time = rec->scheduled_time;
+    set_service_detail(s, client_name, origem, destino);
+    services[s].vehicle_id = rec->vehicle_id;
+    services[s].status = rec->status;
+    count_service_status(rec->status, 1);
+    services[s].distance_km = rec->distance_km;
+    int_index_put(&service_by_id, rec->id, s);
+
+    if (rec->id >= next_service_id) next_service_id = rec->id + 1;
+    return s;
+}
+
+// --- Devolver ao Cliente os Serviços de uma Sessão Anterior (chamar com services_lock em escrita) ---
+// Depois de um reinício os PIDs guardados já não têm sessão: o nome identifica o dono.
+// Só a partir daqui as reservas entram na fila à sua hora.
+int rebind_client_services(const char* client_name, int client_pid) {
+    // Nome nunca usado num serviço: nada a devolver
+    int name_id = name_index_get(&string_by_text, client_name);
+    if (name_id == -1) return 0;
+
+    int count = 0;
+    for (int s = 0; s < service_table.high_water; s++) {
+        if (!service_table.used[s]) continue;
+        if (services[s].client_pid == 0 && services[s].status == STATUS_SCHEDULED &&
+            service_details[s].client_name_id == name_id) {
+            services[s].client_pid = client_pid;
+            pending_push(s);  // A entrada do prazo fica obsoleta quando o serviço sair de AGENDADO
+            count++;
+        }
+    }
+    if (count > 0) {
+        wake_scheduler_if_due();
+    }
+    return count;
+}
+
+// --- Thread do Log (group commit: um write e um fdatasync por lote) ---
+void* wal_thread(void* arg) {
+    while (keep_running) {
+        pthread_mutex_lock(&wal_mutex);
+        while (wal_buffer_size == 0 && !wal_closed) {
+            pthread_cond_wait(&wal_cond, &wal_mutex);
+        }
+        int closed = wal_closed;
+        pthread_mutex_unlock(&wal_mutex);
+        if (closed) break;
+
+        // Enquanto o fdatasync corre, os registos seguintes juntam-se no outro buffer
+        off_t size = wal_flush();
+        if (size == -1) {
+            usleep(WAL_RETRY_MS * 1000);  // O lote voltou ao buffer: tentar mais tarde
+        } else if (size >= WAL_SNAPSHOT_BYTES) {
+            wal_snapshot();
+        }
+    }
+    return NULL;
+}
+
+// --- Acrescentar Registo ao Log (chamar com o lock da tabela alterada) ---
+void wal_append(uint16_t type, const void* payload, size_t len) {
+    if (wal_fd == -1) return;
+
+    WalHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = WAL_MAGIC;
+    hdr.sim_time_ms = sim_time_now_ms();
+    hdr.type = type;
+    hdr.length = (uint16_t)len;
+    size_t needed = sizeof(WalHeader) + len;
+
+    pthread_mutex_lock(&wal_mutex);
+    if (wal_closed) {
+        pthread_mutex_unlock(&wal_mutex);
+        return;
+    }
+    if (wal_buffer_size + needed > wal_buffer_capacity) {
+        size_t new_capacity = wal_buffer_capacity > 0 ? wal_buffer_capacity * 2 : 16384;
+        while (new_capacity < wal_buffer_size + needed) new_capacity *= 2;
+        char* grown = realloc(wal_buffer, new_capacity);
+        if (grown == NULL) {
+            pthread_mutex_unlock(&wal_mutex);
+            log_write(LOG_WARN, "Sem memória, transição não registada no log");
+            return;
+        }
+        wal_buffer = grown;
+        wal_buffer_capacity = new_capacity;
+    }
+    int was_empty = (wal_buffer_size == 0);
+
+    hdr.lsn = wal_next_lsn++;
+    wal_last_lsn = hdr.lsn;
+    hdr.checksum = wal_checksum(&hdr, payload, len);
+    memcpy(wal_buffer + wal_buffer_size, &hdr, sizeof(WalHeader));
+    memcpy(wal_buffer + wal_buffer_size + sizeof(WalHeader), payload, len);
+    wal_buffer_size += needed;
+
+    if (was_empty) {
+        pthread_cond_signal(&wal_cond);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+void wal_log_booking(int service_idx) {
+    ServiceRecord rec;
+    service_to_record(service_idx, 0, &rec);
+    wal_append(WAL_SERVICE_BOOKED, &rec, sizeof(rec));
+}
+
+void wal_log_event(uint16_t type, int service_id, int value) {
+    WalServiceEvent ev = { service_id, value };
+    wal_append(type, &ev, sizeof(ev));
+}
+
+// --- Escrever Registos Acumulados (devolve o tamanho do log; -1 se a escrita falhou) ---
+off_t wal_flush() {
+    pthread_mutex_lock(&wal_writer_mutex);
+
+    pthread_mutex_lock(&wal_mutex);
+    char* batch = wal_buffer;
+    size_t batch_size = wal_buffer_size;
+    size_t batch_capacity = wal_buffer_capacity;
+    uint64_t batch_lsn = wal_next_lsn - 1;
+    wal_buffer = wal_spare;
+    wal_buffer_capacity = wal_spare_capacity;
+    wal_buffer_size = 0;
+    pthread_mutex_unlock(&wal_mutex);
+
+    int failed = batch_size > 0 && wal_write_batch(batch, batch_size) == -1;
+
+    pthread_mutex_lock(&wal_mutex);
+    if (failed) {
+        // Nada do lote está garantido: volta para a frente do buffer e quem
+        // espera por ele é avisado da falha
+        wal_requeue(&batch, &batch_capacity, batch_size);
+        wal_failed_batches++;
+        pthread_cond_broadcast(&wal_durable_cond);
+    } else if (batch_lsn > wal_durable_lsn) {
+        wal_durable_lsn = batch_lsn;
+        pthread_cond_broadcast(&wal_durable_cond);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+
+    // O lote escrito passa a ser o buffer livre
+    wal_spare = batch;
+    wal_spare_capacity = batch_capacity;
+    off_t size = failed ? -1 : wal_file_size;
+    pthread_mutex_unlock(&wal_writer_mutex);
+    return size;
+}
+
+// --- Devolver um Lote que Falhou à Frente do Buffer (chamar com wal_mutex) ---
+// Os registos acrescentados entretanto têm LSN maior e ficam a seguir. Em
+// 'batch' fica o buffer que deixou de ser usado.
+void wal_requeue(char** batch, size_t* batch_capacity, size_t batch_size) {
+    size_t needed = batch_size + wal_buffer_size;
+    if (needed > *batch_capacity) {
+        char* grown = realloc(*batch, needed);
+        if (grown == NULL) {
+            log_write(LOG_ERROR, "Sem memória, %zu bytes do log de estado perdidos", batch_size);
+            return;
+        }
+        *batch = grown;
+        *batch_capacity = needed;
+    }
+    memcpy(*batch + batch_size, wal_buffer, wal_buffer_size);
+
+    char* freed = wal_buffer;
+    size_t freed_capacity = wal_buffer_capacity;
+    wal_buffer = *batch;
+    wal_buffer_capacity = *batch_capacity;
+    wal_buffer_size = needed;
+    *batch = freed;
+    *batch_capacity = freed_capacity;
+}
+
+// --- Escrever um Lote no Fim do Log e Sincronizar (chamar com wal_writer_mutex) ---
+int wal_write_batch(const char* batch, size_t size) {
+    // Os serviços terminados no lote já estão no arquivo: vão para disco primeiro
+    if (archive_sync() == -1 || write_full(wal_fd, batch, size) == -1 || fdatasync(wal_fd) == -1) {
+        // Sem disco não há garantias, mas o controlador continua a servir. O que
+        // ficou escrito a meio é cortado: o lote volta a ser escrito inteiro.
+        log_write(LOG_WARN, "Erro ao escrever log de estado: %s", strerror(errno));
+        ftruncate(wal_fd, wal_file_size);
+        return -1;
+    }
+    wal_file_size += size;
+    return 0;
+}
+
+// --- Esperar que o Registo 'lsn' Esteja em Disco (-1 se uma escrita falhou entretanto) ---
+int wal_sync(uint64_t lsn) {
+    if (wal_fd == -1 || lsn == 0) return 0;
+
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t failures = wal_failed_batches;
+    while (wal_durable_lsn < lsn && wal_failed_batches == failures) {
+        pthread_cond_wait(&wal_durable_cond, &wal_mutex);
+    }
+    int durable = wal_durable_lsn >= lsn;
+    pthread_mutex_unlock(&wal_mutex);
+    return durable ? 0 : -1;
+}
+
+// --- Gravar Snapshot e Esvaziar o Log (-1 em erro; chamar sem locks de dados) ---
+int wal_snapshot() {
+    pthread_mutex_lock(&wal_writer_mutex);
+
+    // Com os locks de dados em leitura não há transições a registar: o estado
+    // lido a seguir inclui todos os registos com LSN inferior a 'boundary'
+    // (o progresso é guardado no veículo antes do seu registo ser acrescentado)
+    timed_rdlock(&services_lock);
+    timed_rdlock(&fleet_lock);
+
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t boundary = wal_next_lsn;
+    char* batch = wal_buffer;
+    size_t batch_size = wal_buffer_size;
+    size_t batch_capacity = wal_buffer_capacity;
+    wal_buffer = wal_spare;
+    wal_buffer_capacity = wal_spare_capacity;
+    wal_buffer_size = 0;
+    pthread_mutex_unlock(&wal_mutex);
+
+    char* data = NULL;
+    size_t data_size = 0;
+    FILE* out = open_memstream(&data, &data_size);
+    SnapshotHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.lsn = boundary;
+    hdr.sim_time_ms = sim_time_now_ms();
+    hdr.next_service_id = next_service_id;
+    if (out != NULL) {
+        fwrite(&hdr, sizeof(hdr), 1, out);
+        for (int s = 0; s < service_table.high_water; s++) {
+            if (!service_table.used[s]) continue;
+            if (services[s].status != STATUS_SCHEDULED && services[s].status != STATUS_IN_PROGRESS) continue;
+
+            ServiceRecord rec;
+            service_to_record(s, service_progress(s), &rec);
+            fwrite(&rec, sizeof(rec), 1, out);
+            hdr.count++;
+        }
+    }
+
+    timed_unlock(&fleet_lock);
+    timed_unlock(&services_lock);
+
+    int ok = 0;
+    if (out != NULL && fclose(out) == 0) {
+        memcpy(data, &hdr, sizeof(hdr));
+        hdr.checksum = fnv1a_update(2166136261u, data + offsetof(SnapshotHeader, lsn),
+                                    data_size - offsetof(SnapshotHeader, lsn));
+        memcpy(data, &hdr, sizeof(hdr));
+
+        // Escrever ao lado e trocar com rename: há sempre um snapshot completo
+        char tmp_path[PATH_MAX], path[PATH_MAX];
+        state_path(tmp_path, sizeof(tmp_path), SNAPSHOT_FILE ".tmp");
+        state_path(path, sizeof(path), SNAPSHOT_FILE);
+        // O snapshot deixa de fora os serviços terminados: têm de estar no arquivo em disco
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ok = archive_sync() == 0 && fd != -1 && write_full(fd, data, data_size) != -1 && fsync(fd) == 0;
+        if (fd != -1) close(fd);
+        ok = ok && rename(tmp_path, path) == 0;
+        if (ok) {
+            int dir_fd = open(state_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dir_fd != -1) {
+                fsync(dir_fd);
+                close(dir_fd);
+            }
+        }
+    }
+    free(data);
+
+    if (ok) {
+        // Os registos anteriores ao snapshot deixam de ser precisos
+        if (ftruncate(wal_fd, 0) == 0) {
+            wal_file_size = 0;
+        }
+    }
+
+    // Snapshot falhou: os registos do lote continuam a ir para o log
+    int failed = !ok && batch_size > 0 && wal_write_batch(batch, batch_size) == -1;
+
+    pthread_mutex_lock(&wal_mutex);
+    if (failed) {
+        wal_requeue(&batch, &batch_capacity, batch_size);
+        wal_failed_batches++;
+        pthread_cond_broadcast(&wal_durable_cond);
+    } else if (boundary - 1 > wal_durable_lsn) {
+        wal_durable_lsn = boundary - 1;
+        pthread_cond_broadcast(&wal_durable_cond);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+
+    wal_spare = batch;
+    wal_spare_capacity = batch_capacity;
+    pthread_mutex_unlock(&wal_writer_mutex);
+    return ok ? 0 : -1;
+}
+
+// --- Fechar o Log no Encerramento (as reservas por terminar ficam para o próximo arranque) ---
+void wal_close() {
+    if (wal_fd == -1) return;
+
+    // A partir daqui, clientes a sair já não cancelam as suas reservas em disco
+    pthread_mutex_lock(&wal_mutex);
+    wal_closed = 1;
+    pthread_cond_signal(&wal_cond);
+    pthread_mutex_unlock(&wal_mutex);
+
+    wal_flush();
+}
+
+uint32_t wal_checksum(const WalHeader* hdr, const void* payload, size_t len) {
+    uint32_t h = fnv1a_update(2166136261u, (const char*)hdr + offsetof(WalHeader, lsn),
+                              sizeof(WalHeader) - offsetof(WalHeader, lsn));
+    return fnv1a_update(h, payload, len);
+}
+
+uint32_t fnv1a_update(uint32_t h, const void* data, size_t len) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void state_path(char* out, size_t size, const char* file) {
+    snprintf(out, size, "%s/%s", state_dir, file);
+}
+
+// --- Progresso da Viagem de um Serviço (0 se não está em curso; chamar com fleet_lock) ---
+int service_progress(int service_idx) {
+    if (services[service_idx].status != STATUS_IN_PROGRESS) return 0;
+    int v = find_vehicle(services[service_idx].vehicle_id);
+    if (v == -1 || vehicles[v].service_id != services[service_idx].id) return 0;
+    return __atomic_load_n(&vehicles[v].progress_percent, __ATOMIC_RELAXED);
+}
+
+// --- Tirar Serviço Terminado da Tabela (chamar com services_lock em escrita) ---
+// A tabela fica só com serviços por terminar: os slots libertados são
+// reutilizados primeiro, por isso as iterações não crescem com o histórico.
+// O registo terminal vai para o log depois do arquivo: a thread do log
+// sincroniza o arquivo antes de o tornar durável (archive_sync), e a
+// recuperação pode esquecer o serviço sem o perder do histórico.
+void retire_service(int service_idx, int progress_percent) {
+    archive_service(service_idx, progress_percent);
+    wal_log_event(services[service_idx].status == STATUS_COMPLETED ? WAL_SERVICE_COMPLETED : WAL_SERVICE_CANCELLED,
+                  services[service_idx].id, 0);
+    drop_service(service_idx);
+}
+
+void drop_service(int service_idx) {
+    count_service_status(services[service_idx].status, -1);  // Por terminar só ao aplicar o log
+    const ServiceDetail* detail = &service_details[service_idx];
+    string_release(detail->client_name_id);
+    string_release(detail->origem_id);
+    string_release(detail->destino_id);
+    int_index_remove(&service_by_id, services[service_idx].id);
+    slab_free(&service_table, service_idx);
+}
+
+// --- Arquivo de Viagens: Abrir e Mapear ---
+void archive_init() {
+    if (wal_fd != -1) {
+        state_path(archive_path, sizeof(archive_path), ARCHIVE_FILE);
+    } else {
+        snprintf(archive_path, sizeof(archive_path), ARCHIVE_TMP_FMT, getpid());
+    }
+
+    archive_fd = open(archive_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (archive_fd == -1 || fstat(archive_fd, &st) == -1) {
+        perror("[CONTROLADOR] Erro ao abrir arquivo de viagens");
+        exit(1);
+    }
+
+    size_t bytes = st.st_size;
+    int fresh = bytes < sizeof(ArchiveHeader);
+    if (fresh) {
+        bytes = sizeof(ArchiveHeader) + ARCHIVE_INITIAL_RECORDS * sizeof(ServiceRecord);
+        if (ftruncate(archive_fd, bytes) == -1) {
+            perror("[CONTROLADOR] Erro ao criar arquivo de viagens");
+            exit(1);
+        }
+    }
+
+    archive_map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, archive_fd, 0);
+    if (archive_map == MAP_FAILED) {
+        perror("[CONTROLADOR] Erro ao mapear arquivo de viagens");
+        exit(1);
+    }
+
+    ArchiveHeader* hdr = archive_map;
+    if (fresh) {
+        hdr->magic = ARCHIVE_MAGIC;
+        hdr->record_size = sizeof(ServiceRecord);
+        hdr->count = 0;
+    } else if (hdr->magic != ARCHIVE_MAGIC || hdr->record_size != sizeof(ServiceRecord)) {
+        fprintf(stderr, "[CONTROLADOR] Erro: Arquivo %s inválido\n", archive_path);
+        exit(1);
+    }
+
+    archive_capacity = (bytes - sizeof(ArchiveHeader)) / sizeof(ServiceRecord);
+    if (hdr->count > archive_capacity) hdr->count = archive_capacity;
+    archive_synced_count = hdr->count;
+    if (hdr->count > 0) {
+        printf("[CONTROLADOR] Histórico com %llu viagem(ns) arquivada(s).\n", (unsigned long long)hdr->count);
+    }
+}
+
+ServiceRecord* archive_records() {
+    return (ServiceRecord*)((char*)archive_map + sizeof(ArchiveHeader));
+}
+
+// --- Acrescentar Serviço ao Arquivo (registo de tamanho fixo no fim do ficheiro) ---
+void archive_service(int service_idx, int progress_percent) {
+    if (archive_map == NULL) return;
+
+    ServiceRecord rec;
+    service_to_record(service_idx, progress_percent, &rec);
+
+    pthread_rwlock_wrlock(&archive_lock);
+    ArchiveHeader* hdr = archive_map;
+    if (hdr->count == archive_capacity && archive_grow() == -1) {
+        pthread_rwlock_unlock(&archive_lock);
+        log_write(LOG_WARN, "Arquivo cheio, serviço ID %d não arquivado", rec.id);
+        return;
+    }
+    hdr = archive_map;
+    archive_records()[hdr->count] = rec;
+    // O contador só avança depois do registo: uma falha nunca deixa um registo a meio
+    __atomic_store_n(&hdr->count, hdr->count + 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&archive_lock);
+}
+
+// --- Levar para Disco os Registos Arquivados desde a Última Vez (chamar com wal_writer_mutex) ---
+// Os registos primeiro e o cabeçalho depois: o contador nunca aponta para lixo.
+int archive_sync() {
+    if (archive_map == NULL) return 0;
+
+    pthread_rwlock_rdlock(&archive_lock);
+    ArchiveHeader* hdr = archive_map;
+    uint64_t count = __atomic_load_n(&hdr->count, __ATOMIC_ACQUIRE);
+    int result = 0;
+    if (count > archive_synced_count) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = sizeof(ArchiveHeader) + archive_synced_count * sizeof(ServiceRecord);
+        size_t end = sizeof(ArchiveHeader) + count * sizeof(ServiceRecord);
+        start -= start % page;
+        if (msync((char*)archive_map + start, end - start, MS_SYNC) == -1 ||
+            msync(archive_map, sizeof(ArchiveHeader), MS_SYNC) == -1) {
+            result = -1;
+        } else {
+            archive_synced_count = count;
+        }
+    }
+    pthread_rwlock_unlock(&archive_lock);
+    return result;
+}
+
+// --- Duplicar o Ficheiro do Arquivo e Voltar a Mapear (chamar com archive_lock em escrita) ---
+int archive_grow() {
+    size_t new_capacity = archive_capacity * 2;
+    size_t old_bytes = sizeof(ArchiveHeader) + archive_capacity * sizeof(ServiceRecord);
+    size_t new_bytes = sizeof(ArchiveHeader) + new_capacity * sizeof(ServiceRecord);
+    if (ftruncate(archive_fd, new_bytes) == -1) return -1;
+
+    void* map = mmap(NULL, new_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, archive_fd, 0);
+    if (map == MAP_FAILED) return -1;
+    munmap(archive_map, old_bytes);
+    archive_map = map;
+    archive_capacity = new_capacity;
+    return 0;
+}
+
+// --- Comandos Administrativos ---
+// As listagens são montadas em memória com o lock em leitura e só depois
+// escritas no terminal, para não bloquear a telemetria enquanto se imprime.
+void cmd_listar() {
+    char* text = NULL;
+    size_t text_size = 0;
+    FILE* out = open_memstream(&text, &text_size);
+    if (out == NULL) return;
+
+    timed_rdlock(&services_lock);
+    int count = 0;
+    for (int i = 0; i < service_table.high_water; i++) {
+        if (!service_table.used[i]) continue;
+        if (services[i].status == STATUS_SCHEDULED || services[i].status == STATUS_IN_PROGRESS) {
+            const char* status_str = (services[i].status == STATUS_SCHEDULED) ? "AGENDADO" : "EM CURSO";
+            fprintf(out, "  [ID:%d] %s -> %s | Cliente: %s | Veículo: %d | Status: %s\n",
+                services[i].id, string_of(service_details[i].origem_id),
+                string_of(service_details[i].destino_id),
+                string_of(service_details[i].client_name_id), services[i].vehicle_id, status_str);
+            count++;
+        }
+    }
+    timed_unlock(&services_lock);
+    fclose(out);
+
+    printf("[CONTROLADOR] == SERVIÇOS AGENDADOS ==\n");
+    if (count == 0) {
+        printf("  (Nenhum serviço agendado ou em curso)\n");
+    } else {
+        fputs(text, stdout);
+    }
+    free(text);
+}
+
+void cmd_utiliz() {
+    char* text = NULL;
+    size_t text_size = 0;
+    FILE* out = open_memstream(&text, &text_size);
+    if (out == NULL) return;
+
+    timed_rdlock(&clients_lock);
+    int count = client_table.count;
+    for (int i = 0; i < client_table.high_water; i++) {
+        if (!client_table.used[i]) continue;
+        ClientStatus client_status = __atomic_load_n(&clients[i].status, __ATOMIC_RELAXED);
+        const char* status = (client_status == CLIENT_ON_TRIP) ? "EM VIAGEM" : "À ESPERA";
+        fprintf(out, "  - %s (PID: %d) [%s]\n", clients[i].name, clients[i].pid, status);
+    }
+    timed_unlock(&clients_lock);
+    fclose(out);
+
+    printf("[CONTROLADOR] == UTILIZADORES LIGADOS (%d) ==\n", count);
+    if (count == 0) {
+        printf("  (Nenhum utilizador ligado)\n");
+    } else {
+        fputs(text, stdout);
+    }
+    free(text);
+}
+
+void cmd_frota() {
+    char* text = NULL;
+    size_t text_size = 0;
+    FILE* out = open_memstream(&text, &text_size);
+    if (out == NULL) return;
+
+    timed_rdlock(&fleet_lock);
+    for (int i = 0; i < vehicle_table.high_water; i++) {
+        if (vehicles[i].process_pid == 0) {
+            fprintf(out, "  [Veículo %d] FORA DE SERVIÇO\n", vehicles[i].id);
+        } else if (vehicles[i].available == VEHICLE_AVAILABLE) {
+            fprintf(out, "  [Veículo %d] DISPONÍVEL em (%.1f, %.1f) km\n",
+                vehicles[i].id, vehicles[i].position.x, vehicles[i].position.y);
+        } else {
+            fprintf(out, "  [Veículo %d] EM SERVIÇO - Progresso: %d%% (Serviço ID: %d) desde (%.1f, %.1f) km\n",
+                vehicles[i].id, __atomic_load_n(&vehicles[i].progress_percent, __ATOMIC_RELAXED),
+                vehicles[i].service_id, vehicles[i].position.x, vehicles[i].position.y);
+        }
+    }
+    timed_unlock(&fleet_lock);
+    fclose(out);
+
+    printf("[CONTROLADOR] == ESTADO DA FROTA ==\n");
+    fputs(text, stdout);
+    free(text);
+}
+
+void cmd_cancelar(int service_id) {
+    int cancelled = 0;
+
+    timed_rdlock(&clients_lock);
+    timed_wrlock(&services_lock);
+    timed_wrlock(&fleet_lock);
+    
+    if (service_id == 0) {
+        for (int i = 0; i < service_table.high_water; i++) {
+            if (service_table.used[i]) cancelled += admin_cancel_service(i);
+        }
+    } else {
+        int i = find_service(service_id);
+        if (i != -1) {
+            cancelled = admin_cancel_service(i);
+        }
+    }
+    
+    timed_unlock(&fleet_lock);
+    timed_unlock(&services_lock);
+    timed_unlock(&clients_lock);
+
+    if (service_id == 0) {
+        printf("[CONTROLADOR] %d serviço(s) cancelado(s).\n", cancelled);
+    } else if (cancelled > 0) {
+        printf("[CONTROLADOR] Serviço ID %d cancelado.\n", service_id);
+    } else {
+        printf("[CONTROLADOR] Serviço ID %d não encontrado ou já finalizado.\n", service_id);
+    }
+}
+
+// --- Cancelar um Serviço pelo Admin (1 se cancelou; chamar com clients, services e fleet) ---
+int admin_cancel_service(int service_idx) {
+    ServiceInfo* srv = &services[service_idx];
+    if (srv->status != STATUS_SCHEDULED && srv->status != STATUS_IN_PROGRESS) return 0;
+
+    int progress = service_progress(service_idx);
+    set_service_status(service_idx, STATUS_CANCELLED);
+    
+    // Atualizar cliente
+    int c = find_client(srv->client_pid);
+    if (c != -1) {
+        set_client_status(c, CLIENT_WAITING);
+    }
+    
+    // Mandar o veículo parar; a telemetria que ainda chegue desta viagem é ignorada
+    int v = find_vehicle(srv->vehicle_id);
+    if (v != -1 && vehicles[v].service_id == srv->id) {
+        int32_t target = srv->id;
+        send_vehicle_command(v, OP_VEHICLE_CANCEL, &target, sizeof(target));
+        reset_vehicle(v);
+    }
+    
+    int client_pid = srv->client_pid;
+    retire_service(service_idx, progress);
+    send_response(client_pid, 0, "Serviço cancelado");
+    return 1;
+}
+
+void cmd_km() {
+    double total_km = 0.0;
+
+    timed_rdlock(&fleet_lock);
+    for (int i = 0; i < vehicle_table.high_water; i++) {
+        double km;
+        __atomic_load(&vehicles[i].total_km, &km, __ATOMIC_RELAXED);
+        total_km += km;
+    }
+    timed_unlock(&fleet_lock);
+    
+    printf("[CONTROLADOR] Quilómetros totais percorridos: %.2f km\n", total_km);
+}
+
+void cmd_hora() {
+    int now = sim_time_now();
+    int hours = now / 3600;
+    int minutes = (now % 3600) / 60;
+    int seconds = now % 60;
+    
+    printf("[CONTROLADOR] Tempo simulado: %02d:%02d:%02d (%d segundos)", hours, minutes, seconds, now);
+    if (time_speed != 1.0) {
+        printf(" a %gx", time_speed);
+    }
+    printf("\n");
+}
+
+// --- Histórico: Últimas Viagens do Arquivo (as mais recentes primeiro) ---
+void cmd_historico(const char* client_name) {
+    char* text = NULL;
+    size_t text_size = 0;
+    FILE* out = open_memstream(&text, &text_size);
+    if (out == NULL) return;
+
+    pthread_rwlock_rdlock(&archive_lock);
+    const ServiceRecord* records = archive_records();
+    uint64_t total = ((ArchiveHeader*)archive_map)->count;
+    int shown = 0;
+    for (uint64_t i = total; i > 0 && shown < HISTORY_LINES; i--) {
+        const ServiceRecord* rec = &records[i - 1];
+        if (client_name != NULL && strcmp(rec->client_name, client_name) != 0) continue;
+
+        fprintf(out, "  [ID:%d] %s -> %s | Cliente: %s | Veículo: %d | %02d:%02d:%02d | %.1fkm | ",
+                rec->id, rec->origem, rec->destino, rec->client_name, rec->vehicle_id,
+                rec->scheduled_time / 3600, (rec->scheduled_time % 3600) / 60, rec->scheduled_time % 60,
+                rec->distance_km);
+        if (rec->status == STATUS_COMPLETED) {
+            fprintf(out, "CONCLUÍDA\n");
+        } else {
+            fprintf(out, "CANCELADA (%d%%)\n", rec->progress_percent);
         }
+        shown++;
     }
-    
-    // Fechar todos os file descriptors ao terminar
-    for (int i = 0; i < MAX_VEHICLES; i++) {
-        if (vehicle_telemetry_fds[i] != -1) {
-            close(vehicle_telemetry_fds[i]);
-            vehicle_telemetry_fds[i] = -1;
+    pthread_rwlock_unlock(&archive_lock);
+    fclose(out);
+
+    printf("[CONTROLADOR] == HISTÓRICO (%llu viagem(ns) arquivada(s)) ==\n", (unsigned long long)total);
+    if (shown == 0) {
+        printf("  (Nenhuma viagem terminada)\n");
+    } else {
+        fputs(text, stdout);
+    }
+    free(text);
+}
+
+// --- Estatísticas: Registo (sem locks no caminho quente) ---
+uint64_t stats_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Shard da thread atual, criado no primeiro registo (NULL sem memória: a medida perde-se)
+StatsShard* stats_local() {
+    if (stats_shard == NULL) {
+        StatsShard* shard = calloc(1, sizeof(StatsShard));
+        if (shard == NULL) return NULL;
+        pthread_mutex_lock(&stats_mutex);
+        shard->next = stats_shards;
+        stats_shards = shard;
+        pthread_mutex_unlock(&stats_mutex);
+        stats_shard = shard;
+    }
+    return stats_shard;
+}
+
+// Só a thread dona escreve: load + store relaxed chega (o leitor vê valores inteiros)
+void stats_add(_Atomic uint64_t* cell, uint64_t n) {
+    atomic_store_explicit(cell, atomic_load_explicit(cell, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void stats_record(StatHistogram stat, uint64_t value) {
+    StatsShard* shard = stats_local();
+    if (shard == NULL) return;
+
+    StatsHistogram* h = &shard->histograms[stat];
+    stats_add(&h->count, 1);
+    stats_add(&h->sum, value);
+    stats_add(&h->buckets[stats_bucket(value)], 1);
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+    }
+}
+
+void stats_count(StatCounter counter, uint64_t n) {
+    StatsShard* shard = stats_local();
+    if (shard != NULL) stats_add(&shard->counters[counter], n);
+}
+
+// Balde log-linear: valores < 16 são exatos; acima, cada potência de 2 tem 16 baldes
+int stats_bucket(uint64_t value) {
+    if (value < STATS_SUB_BUCKETS) return (int)value;
+    if (value >= (1ull << STATS_MAX_BITS)) value = (1ull << STATS_MAX_BITS) - 1;
+
+    int shift = 63 - __builtin_clzll(value) - STATS_SUB_BITS;
+    return (shift + 1) * STATS_SUB_BUCKETS + (int)((value >> shift) - STATS_SUB_BUCKETS);
+}
+
+// Maior valor que cai no balde
+uint64_t stats_bucket_value(int bucket) {
+    if (bucket < STATS_SUB_BUCKETS) return bucket;
+
+    int shift = bucket / STATS_SUB_BUCKETS - 1;
+    uint64_t top = bucket % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+uint64_t stats_percentile(const uint64_t* buckets, uint64_t count, uint64_t max, double p) {
+    uint64_t rank = (uint64_t)ceil(p * count);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            uint64_t value = stats_bucket_value(b);
+            return value < max ? value : max;
         }
     }
-    
-    if (telemetry_pipe_read != -1) {
-        close(telemetry_pipe_read);
+    return max;
+}
+
+// --- Estatísticas: Soma de Todos os Shards ---
+// Os shards nunca são libertados e só se acrescentam à cabeça da lista:
+// basta o mutex para ler a cabeça, o resto percorre-se sem locks.
+StatsShard* stats_first_shard() {
+    pthread_mutex_lock(&stats_mutex);
+    StatsShard* first = stats_shards;
+    pthread_mutex_unlock(&stats_mutex);
+    return first;
+}
+
+void stats_collect(StatHistogram stat, uint64_t* buckets, uint64_t* count, uint64_t* sum, uint64_t* max) {
+    *count = *sum = *max = 0;
+    memset(buckets, 0, STATS_BUCKETS * sizeof(uint64_t));
+    for (StatsShard* shard = stats_first_shard(); shard != NULL; shard = shard->next) {
+        StatsHistogram* h = &shard->histograms[stat];
+        *count += atomic_load_explicit(&h->count, memory_order_relaxed);
+        *sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+        uint64_t shard_max = atomic_load_explicit(&h->max, memory_order_relaxed);
+        if (shard_max > *max) *max = shard_max;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        }
     }
-    
-    return NULL;
 }
 
-// --- Processar Telemetria do Veículo ---
-void process_vehicle_telemetry(char* line, int vehicle_id) {
-    // Formato: TIPO|vehicle_id|service_id|dados...
-    char type[50];
-    int vid, service_id;
-    
-    if (sscanf(line, "%49[^|]|%d|%d", type, &vid, &service_id) < 3) {
-        if (strcmp(line, "CANCELLED") == 0) {
-            strcpy(type, "CANCELLED");
-        } else {
-            return;
+uint64_t stats_counter_total(StatCounter counter) {
+    uint64_t total = 0;
+    for (StatsShard* shard = stats_first_shard(); shard != NULL; shard = shard->next) {
+        total += atomic_load_explicit(&shard->counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+// --- Estatísticas: Locks por Área (tempo de espera e de posse) ---
+int lock_area_of(pthread_rwlock_t* lock) {
+    if (lock == &clients_lock) return LOCK_CLIENTS;
+    if (lock == &services_lock) return LOCK_SERVICES;
+    return LOCK_FLEET;
+}
+
+void timed_rdlock(pthread_rwlock_t* lock) {
+    uint64_t start = stats_now_ns();
+    pthread_rwlock_rdlock(lock);
+    lock_acquired(lock_area_of(lock), start);
+}
+
+void timed_wrlock(pthread_rwlock_t* lock) {
+    uint64_t start = stats_now_ns();
+    pthread_rwlock_wrlock(lock);
+    lock_acquired(lock_area_of(lock), start);
+}
+
+void lock_acquired(int area, uint64_t wait_start) {
+    uint64_t now = stats_now_ns();
+    stats_record(STAT_CLIENTS_LOCK_WAIT + 2 * area, now - wait_start);
+    // Leituras aninhadas na mesma thread: a posse conta desde a primeira
+    if (lock_depth[area]++ == 0) lock_acquired_ns[area] = now;
+}
+
+void timed_unlock(pthread_rwlock_t* lock) {
+    int area = lock_area_of(lock);
+    if (--lock_depth[area] == 0) {
+        stats_record(STAT_CLIENTS_LOCK_HOLD + 2 * area, stats_now_ns() - lock_acquired_ns[area]);
+    }
+    pthread_rwlock_unlock(lock);
+}
+
+// --- Estatísticas: Comando stats ---
+void format_duration(char* out, size_t size, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(out, size, "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(out, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(out, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(out, size, "%.2fs", ns / 1e9);
+    }
+}
+
+void cmd_stats() {
+    static const char* names[STAT_NUM_HISTOGRAMS] = {
+        "Pedido LOGIN", "Pedido TRANSPORTE", "Pedido CANCELAR", "Pedido CONSULTAR", "Pedido TERMINAR",
+        "Entrega de resposta", "Lock clientes: espera", "Lock clientes: posse",
+        "Lock serviços: espera", "Lock serviços: posse", "Lock frota: espera", "Lock frota: posse",
+        "Ciclo do agendador", "Atraso de despacho*",
+    };
+    uint64_t buckets[STATS_BUCKETS];
+
+    printf("[CONTROLADOR] == ESTATÍSTICAS ==\n");
+    printf("  %-24s %9s %10s %9s %9s %9s %10s\n", "Medida", "n", "média", "p50", "p99", "p999", "máx");
+
+    for (int stat = 0; stat < STAT_NUM_HISTOGRAMS; stat++) {
+        uint64_t count, sum, max;
+        stats_collect(stat, buckets, &count, &sum, &max);
+
+        // printf alinha por bytes: compensar os caracteres acentuados (UTF-8)
+        int width = 24;
+        for (const char* c = names[stat]; *c != '\0'; c++) {
+            if ((*c & 0xC0) == 0x80) width++;
         }
+        if (count == 0) {
+            printf("  %-*s %9d %9s %9s %9s %9s %9s\n", width, names[stat], 0, "-", "-", "-", "-", "-");
+            continue;
+        }
+        char mean_str[16], p50_str[16], p99_str[16], p999_str[16], max_str[16];
+        format_duration(mean_str, sizeof(mean_str), sum / count);
+        format_duration(p50_str, sizeof(p50_str), stats_percentile(buckets, count, max, 0.50));
+        format_duration(p99_str, sizeof(p99_str), stats_percentile(buckets, count, max, 0.99));
+        format_duration(p999_str, sizeof(p999_str), stats_percentile(buckets, count, max, 0.999));
+        format_duration(max_str, sizeof(max_str), max);
+        printf("  %-*s %9llu %9s %9s %9s %9s %9s\n", width, names[stat], (unsigned long long)count,
+               mean_str, p50_str, p99_str, p999_str, max_str);
     }
-    
-    pthread_mutex_lock(&data_mutex);
+    uint64_t telemetry = stats_counter_total(STAT_TELEMETRY_RECORDS);
 
-    if (strcmp(type, "TRIP_STARTED") == 0) {
-        // Enviar mensagem ao cliente que a viagem iniciou
-        for (int s = 0; s < num_services; s++) {
-            if (services[s].id == service_id && services[s].status == STATUS_IN_PROGRESS) {
-                send_response(services[s].client_pid, 1, "Viagem iniciada!");
-                printf("\r\033[K[CONTROLADOR] Viagem iniciada!\nCMD> ");
-                fflush(stdout);
-                break;
-            }
+    // Ritmo desde o comando stats anterior (ou desde o arranque)
+    uint64_t now = stats_now_ns();
+    double interval_s = (now - stats_last_ns) / 1e9;
+    printf("  Telemetria: %llu registo(s), %.1f/s nos últimos %.1f s\n", (unsigned long long)telemetry,
+           interval_s > 0 ? (telemetry - stats_last_telemetry) / interval_s : 0.0, interval_s);
+    printf("  * em tempo simulado. Ativo há %.1f s.\n", (now - stats_start_ns) / 1e9);
+    stats_last_ns = now;
+    stats_last_telemetry = telemetry;
+}
+
+// --- Métricas: Socket Unix (METRICAS_SOCKET=<caminho>) ---
+// Texto no formato Prometheus. Responde a um GET HTTP (curl --unix-socket)
+// ou, se o cliente não enviar nada, escreve só as métricas (nc -U, socat).
+void metrics_init() {
+    const char* path = getenv("METRICAS_SOCKET");
+    if (path == NULL || path[0] == '\0') return;
+
+    if (strlen(path) >= sizeof(metrics_path)) {
+        printf("[CONTROLADOR] AVISO: METRICAS_SOCKET demasiado longo. Métricas desligadas.\n");
+        return;
+    }
+    snprintf(metrics_path, sizeof(metrics_path), "%s", path);
+
+    // Socket de uma execução anterior: substituir (outro tipo de ficheiro: não mexer)
+    struct stat st;
+    if (lstat(metrics_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            printf("[CONTROLADOR] Erro: %s existe e não é um socket\n", metrics_path);
+            exit(1);
         }
-    } else if (strcmp(type, "PROGRESS") == 0) {
-        int percent;
-        if (sscanf(line, "%*[^|]|%*d|%*d|%d", &percent) == 1) {
-            for (int i = 0; i < num_vehicles; i++) {
-                if (vehicles[i].id == vid) {
-                    vehicles[i].progress_percent = percent;
-                    break;
-                }
-            }
+        unlink(metrics_path);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, metrics_path, strlen(metrics_path) + 1);
+
+    metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_fd == -1 ||
+        bind(metrics_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(metrics_fd, 8) == -1) {
+        perror("[CONTROLADOR] Erro ao criar socket de métricas");
+        exit(1);
+    }
+
+    pthread_t t_metrics;
+    if (pthread_create(&t_metrics, NULL, metrics_thread, NULL) != 0) {
+        perror("[CONTROLADOR] Erro thread métricas");
+        exit(1);
+    }
+    printf("[CONTROLADOR] Métricas em %s.\n", metrics_path);
+}
+
+void* metrics_thread(void* arg) {
+    while (keep_running) {
+        int fd = accept(metrics_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        metrics_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+void metrics_serve(int fd) {
+    struct timeval send_timeout = { METRICS_SEND_TIMEOUT_S, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+    // Pedido HTTP opcional: só interessa saber se é um GET
+    char request[512];
+    ssize_t n = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, METRICS_REQUEST_WAIT_MS) > 0) {
+        n = read(fd, request, sizeof(request) - 1);
+    }
+    int http = n >= 4 && strncmp(request, "GET ", 4) == 0;
+
+    char* body = NULL;
+    size_t body_size = 0;
+    FILE* out = open_memstream(&body, &body_size);
+    if (out == NULL) return;
+    metrics_render(out);
+    fclose(out);
+
+    if (http) {
+        char header[160];
+        int len = snprintf(header, sizeof(header),
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                           "Content-Length: %zu\r\n\r\n", body_size);
+        write_full(fd, header, len);
+    }
+    write_full(fd, body, body_size);
+    free(body);
+}
+
+// Cada área é lida com o seu lock em leitura, sem nunca deter dois ao mesmo tempo
+void metrics_snapshot(MetricsSnapshot* snap) {
+    memset(snap, 0, sizeof(MetricsSnapshot));
+
+    timed_rdlock(&clients_lock);
+    snap->clients_connected = client_table.count;
+    timed_unlock(&clients_lock);
+
+    timed_rdlock(&services_lock);
+    snap->services_scheduled = services_scheduled;
+    snap->services_in_progress = services_in_progress;
+    timed_unlock(&services_lock);
+
+    timed_rdlock(&fleet_lock);
+    for (int i = 0; i < vehicle_table.high_water; i++) {
+        if (!vehicle_table.used[i]) continue;
+        if (vehicles[i].process_pid == 0) {
+            snap->vehicles_offline++;
+        } else if (vehicles[i].available == VEHICLE_AVAILABLE) {
+            snap->vehicles_available++;
+        } else {
+            snap->vehicles_busy++;
         }
-    } else if (strcmp(type, "DISTANCE") == 0) {
         double km;
-        if (sscanf(line, "%*[^|]|%*d|%*d|%lf", &km) == 1) {
-            for (int i = 0; i < num_vehicles; i++) {
-                if (vehicles[i].id == vid) {
-                    double prev_km = vehicles[i].total_km;
-                    vehicles[i].total_km = km;
-                    
-                    printf("\r\033[K[DEBUG] Veículo %d percorreu mais %.1f km. Total: %.1f km\nCMD> ",
-                           vid, km - prev_km, km);
-                    fflush(stdout);
-                    break;
+        __atomic_load(&vehicles[i].total_km, &km, __ATOMIC_RELAXED);
+        snap->total_km += km;
+    }
+    timed_unlock(&fleet_lock);
+
+    if (archive_map != NULL) {
+        pthread_rwlock_rdlock(&archive_lock);
+        snap->trips_archived = ((ArchiveHeader*)archive_map)->count;
+        pthread_rwlock_unlock(&archive_lock);
+    }
+    snap->sim_time_ms = sim_time_now_ms();
+}
+
+void metrics_render(FILE* out) {
+    // Famílias dos histogramas (ordem de StatHistogram); os quantis vêm do histograma
+    static const struct {
+        const char* name;
+        const char* label;  // NULL se a família só tem uma série
+        const char* help;
+    } families[STAT_NUM_HISTOGRAMS] = {
+        { "taxi_request_duration_seconds", "type=\"login\"", "Tempo de tratamento de um pedido." },
+        { "taxi_request_duration_seconds", "type=\"ride\"", NULL },
+        { "taxi_request_duration_seconds", "type=\"cancel\"", NULL },
+        { "taxi_request_duration_seconds", "type=\"consult\"", NULL },
+        { "taxi_request_duration_seconds", "type=\"terminate\"", NULL },
+        { "taxi_response_delivery_seconds", NULL, "Do send_response até ao write no pipe do cliente." },
+        { "taxi_lock_wait_seconds", "lock=\"clients\"", "Espera por um lock de área." },
+        { "taxi_lock_hold_seconds", "lock=\"clients\"", "Tempo com um lock de área." },
+        { "taxi_lock_wait_seconds", "lock=\"services\"", NULL },
+        { "taxi_lock_hold_seconds", "lock=\"services\"", NULL },
+        { "taxi_lock_wait_seconds", "lock=\"fleet\"", NULL },
+        { "taxi_lock_hold_seconds", "lock=\"fleet\"", NULL },
+        { "taxi_scheduler_pass_seconds", NULL, "Duração de uma passagem do agendador." },
+        { "taxi_dispatch_delay_sim_seconds", NULL, "Tempo simulado entre a hora marcada e o despacho." },
+    };
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    MetricsSnapshot snap;
+    metrics_snapshot(&snap);
+    int vehicles_in_service = snap.vehicles_available + snap.vehicles_busy;
+
+    fprintf(out, "# HELP taxi_vehicles Veículos da frota por estado.\n# TYPE taxi_vehicles gauge\n");
+    fprintf(out, "taxi_vehicles{state=\"available\"} %d\n", snap.vehicles_available);
+    fprintf(out, "taxi_vehicles{state=\"busy\"} %d\n", snap.vehicles_busy);
+    fprintf(out, "taxi_vehicles{state=\"offline\"} %d\n", snap.vehicles_offline);
+    fprintf(out, "# HELP taxi_fleet_utilization Fração dos veículos em serviço que estão ocupados.\n"
+                 "# TYPE taxi_fleet_utilization gauge\n");
+    fprintf(out, "taxi_fleet_utilization %.4f\n",
+            vehicles_in_service > 0 ? (double)snap.vehicles_busy / vehicles_in_service : 0.0);
+    fprintf(out, "# HELP taxi_services Serviços por terminar por estado.\n# TYPE taxi_services gauge\n");
+    fprintf(out, "taxi_services{state=\"scheduled\"} %d\n", snap.services_scheduled);
+    fprintf(out, "taxi_services{state=\"in_progress\"} %d\n", snap.services_in_progress);
+    fprintf(out, "# HELP taxi_clients_connected Clientes com sessão aberta.\n# TYPE taxi_clients_connected gauge\n");
+    fprintf(out, "taxi_clients_connected %d\n", snap.clients_connected);
+    fprintf(out, "# HELP taxi_trips_archived_total Viagens terminadas no arquivo.\n"
+                 "# TYPE taxi_trips_archived_total counter\n");
+    fprintf(out, "taxi_trips_archived_total %llu\n", (unsigned long long)snap.trips_archived);
+    fprintf(out, "# HELP taxi_vehicle_km_total Quilómetros percorridos pela frota.\n"
+                 "# TYPE taxi_vehicle_km_total counter\n");
+    fprintf(out, "taxi_vehicle_km_total %.3f\n", snap.total_km);
+    fprintf(out, "# HELP taxi_telemetry_records_total Registos de telemetria tratados.\n"
+                 "# TYPE taxi_telemetry_records_total counter\n");
+    fprintf(out, "taxi_telemetry_records_total %llu\n",
+            (unsigned long long)stats_counter_total(STAT_TELEMETRY_RECORDS));
+    fprintf(out, "# HELP taxi_sim_time_seconds Relógio simulado.\n# TYPE taxi_sim_time_seconds gauge\n");
+    fprintf(out, "taxi_sim_time_seconds %.3f\n", snap.sim_time_ms / 1000.0);
+    fprintf(out, "# HELP taxi_uptime_seconds Tempo desde o arranque do controlador.\n"
+                 "# TYPE taxi_uptime_seconds gauge\n");
+    fprintf(out, "taxi_uptime_seconds %.3f\n", (stats_now_ns() - stats_start_ns) / 1e9);
+
+    // Sumários: as séries de cada família saem juntas, pela ordem da primeira
+    uint64_t buckets[STATS_BUCKETS];
+    for (int first = 0; first < STAT_NUM_HISTOGRAMS; first++) {
+        if (families[first].help == NULL) continue;  // Família já escrita
+        const char* name = families[first].name;
+        fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, families[first].help, name);
+
+        for (int stat = first; stat < STAT_NUM_HISTOGRAMS; stat++) {
+            if (strcmp(families[stat].name, name) != 0) continue;
+            const char* label = families[stat].label;
+            uint64_t count, sum, max;
+            stats_collect(stat, buckets, &count, &sum, &max);
+
+            for (int q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++) {
+                fprintf(out, "%s{%s%squantile=\"%g\"} ", name, label ? label : "", label ? "," : "", quantiles[q]);
+                if (count == 0) {
+                    fprintf(out, "NaN\n");  // Sem amostras (convenção do Prometheus)
+                } else {
+                    fprintf(out, "%.9g\n", stats_percentile(buckets, count, max, quantiles[q]) / 1e9);
                 }
             }
+            fprintf(out, "%s_sum%s%s%s %.9g\n", name, label ? "{" : "", label ? label : "", label ? "}" : "",
+                    sum / 1e9);
+            fprintf(out, "%s_count%s%s%s %llu\n", name, label ? "{" : "", label ? label : "", label ? "}" : "",
+                    (unsigned long long)count);
         }
-    } else if (strcmp(type, "COMPLETED") == 0 || strcmp(type, "CANCELLED") == 0) {
-        
-        for (int i = 0; i < num_services; i++) {
-            if (services[i].id == service_id) {
-                services[i].status = (strcmp(type, "CANCELLED") == 0) ? STATUS_CANCELLED : STATUS_COMPLETED;
-                
-                for (int c = 0; c < num_clients; c++) {
-                    if (clients[c].pid == services[i].client_pid) {
-                        clients[c].status = CLIENT_WAITING;
-
-                        char msg[BUFFER_SIZE];
-                        if (strcmp(type, "COMPLETED") == 0) {
-                            sprintf(msg, "Viagem concluída! Percorridos %.1f km.", services[i].distance_km);
-                        } else {
-                            sprintf(msg, "Viagem cancelada. Serviço ID %d", services[i].id);
-                        }
-                        send_response(clients[c].pid, 1, msg);
-                        break;
-                    }
-                }
+    }
+}
+
+// --- Log Assíncrono: Arranque (LOG_NIVEL, LOG_FICHEIRO, LOG_ROTACAO_KB) ---
+void log_init() {
+    const char* level = getenv("LOG_NIVEL");
+    if (level != NULL) {
+        if (strcmp(level, "debug") == 0) log_level = LOG_DEBUG;
+        else if (strcmp(level, "info") == 0) log_level = LOG_INFO;
+        else if (strcmp(level, "aviso") == 0) log_level = LOG_WARN;
+        else if (strcmp(level, "erro") == 0) log_level = LOG_ERROR;
+    }
+
+    const char* path = getenv("LOG_FICHEIRO");
+    if (path != NULL && path[0] != '\0') {
+        snprintf(log_path, sizeof(log_path), "%s", path);
+        log_file = fopen(log_path, "ae");  // Os veículos não herdam o ficheiro
+        if (log_file == NULL) {
+            perror("[CONTROLADOR] Erro ao abrir LOG_FICHEIRO");
+            exit(1);
+        }
+        fseek(log_file, 0, SEEK_END);
+        log_file_bytes = ftell(log_file);
+        if (getenv("LOG_ROTACAO_KB") != NULL && atol(getenv("LOG_ROTACAO_KB")) > 0) {
+            log_rotate_bytes = atol(getenv("LOG_ROTACAO_KB")) * 1024;
+        }
+
+        struct timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        log_clock_offset_ns = (int64_t)wall.tv_sec * 1000000000ll + wall.tv_nsec - (int64_t)stats_now_ns();
+        printf("[CONTROLADOR] Log em %s\n", log_path);
+    }
+
+    pthread_condattr_t wake_attr;
+    pthread_condattr_init(&wake_attr);
+    pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log_wake_cond, &wake_attr);
+    pthread_condattr_destroy(&wake_attr);
+
+    pthread_t t_log;
+    if (pthread_create(&t_log, NULL, log_thread, NULL) != 0) {
+        perror("[CONTROLADOR] Erro thread log");
+        exit(1);
+    }
+    pthread_detach(t_log);
+}
+
+// --- Registar Mensagem (com o anel cheio a mensagem perde-se e é contada) ---
+// Só a primeira mensagem de um anel vazio pede o mutex, para acordar a thread de log.
+void log_write(LogLevel level, const char* fmt, ...) {
+    if (level < log_level) return;
+    LogRing* ring = log_local();
+    if (ring == NULL) return;
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+        stats_add(&ring->dropped, 1);
+        return;
+    }
+
+    LogRecord* rec = &ring->records[head % LOG_RING_SIZE];
+    rec->time_ns = stats_now_ns();
+    rec->level = (uint8_t)level;
+    va_list args;
+    va_start(args, fmt);
+    log_pack(rec, fmt, args);
+    va_end(args);
+    int was_empty = head == atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    // A thread de log verifica os anéis com este mutex antes de adormecer: o sinal não se perde
+    if (was_empty) {
+        pthread_mutex_lock(&log_wake_mutex);
+        pthread_cond_signal(&log_wake_cond);
+        pthread_mutex_unlock(&log_wake_mutex);
+    }
+}
+
+// --- Guardar os Argumentos de uma Mensagem (a formatação fica para a drenagem) ---
+// Cada conversão do formato diz o tipo do argumento: o atributo format de
+// log_write garante que os tipos batem certo. Só os %s são copiados.
+void log_pack(LogRecord* rec, const char* fmt, va_list args) {
+    rec->fmt = fmt;
+    rec->num_args = 0;
+    rec->strings_len = 0;
+    for (const char* p = fmt; *p != '\0' && rec->num_args < LOG_MAX_ARGS; p++) {
+        if (*p != '%') continue;
+        p++;
+        if (*p == '%') continue;
+        p += strspn(p, "-+ #0123456789.");
+        int longs = 0, sized = 0;
+        while (*p == 'l') { longs++; p++; }
+        if (*p == 'z') { sized = 1; p++; }
+
+        LogArg* arg = &rec->args[rec->num_args];
+        switch (*p) {
+            case 'd': case 'i': case 'c':
+                arg->i = sized ? va_arg(args, ssize_t) : longs == 2 ? va_arg(args, long long) :
+                         longs == 1 ? va_arg(args, long) : va_arg(args, int);
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                arg->u = sized ? va_arg(args, size_t) : longs == 2 ? va_arg(args, unsigned long long) :
+                         longs == 1 ? va_arg(args, unsigned long) : va_arg(args, unsigned);
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+                arg->f = va_arg(args, double);
+                break;
+            case 'p':
+                arg->p = va_arg(args, void*);
+                break;
+            case 's': {
+                // Sem espaço fica o texto cortado (sempre com terminador)
+                const char* text = va_arg(args, const char*);
+                if (text == NULL) text = "(null)";
+                size_t room = LOG_STRINGS_MAX - rec->strings_len;
+                size_t len = strnlen(text, room - 1);
+                arg->str = rec->strings_len;
+                memcpy(rec->strings + rec->strings_len, text, len);
+                rec->strings[rec->strings_len + len] = '\0';
+                rec->strings_len += len + (room > len + 1 ? 1 : 0);
                 break;
             }
+            default:
+                return;  // Conversão não suportada: o resto do formato fica sem argumentos
         }
-        
-        for (int i = 0; i < num_vehicles; i++) {
-            if (vehicles[i].id == vehicle_id) {
-                vehicles[i].available = VEHICLE_AVAILABLE;
-                vehicles[i].active = VEHICLE_INACTIVE;
-                vehicles[i].progress_percent = 0;
-                vehicles[i].service_id = -1;
-                vehicles[i].process_pid = 0;
-                vehicles[i].total_km = 0.0;  // Resetar KM para a próxima viagem
-                
-                // Fechar o FD da telemetria
-                if (vehicle_telemetry_fds[i] != -1) {
-                    close(vehicle_telemetry_fds[i]);
-                    vehicle_telemetry_fds[i] = -1;
-                }
-                
-                // Remover pipe
-                char pipe_path[50];
-                sprintf(pipe_path, PIPE_VEHICLE_FMT, vehicle_id);
-                unlink(pipe_path);
+        rec->num_args++;
+    }
+}
+
+// --- Formatar um Registo (só na drenagem; devolve o comprimento do texto) ---
+size_t log_format(const LogRecord* rec, char* out, size_t size) {
+    size_t len = 0;
+    int n = 0;
+    const char* p = rec->fmt;
+    while (*p != '\0' && len + 1 < size) {
+        if (*p != '%') {
+            out[len++] = *p++;
+            continue;
+        }
+        const char* spec = p++;
+        if (*p == '%') {
+            out[len++] = '%';
+            p++;
+            continue;
+        }
+        p += strspn(p, "-+ #0123456789.");
+        int longs = 0, sized = 0;
+        while (*p == 'l') { longs++; p++; }
+        if (*p == 'z') { sized = 1; p++; }
+        char conv[16];
+        size_t spec_len = p + 1 - spec;
+        if (*p == '\0' || n == rec->num_args || spec_len >= sizeof(conv)) break;
+        memcpy(conv, spec, spec_len);
+        conv[spec_len] = '\0';
+
+        const LogArg* arg = &rec->args[n++];
+        char* dst = out + len;
+        size_t room = size - len;
+        int written = 0;
+        switch (*p) {
+            case 'd': case 'i': case 'c':
+                written = sized ? snprintf(dst, room, conv, (ssize_t)arg->i) :
+                          longs == 2 ? snprintf(dst, room, conv, (long long)arg->i) :
+                          longs == 1 ? snprintf(dst, room, conv, (long)arg->i) :
+                          snprintf(dst, room, conv, (int)arg->i);
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                written = sized ? snprintf(dst, room, conv, (size_t)arg->u) :
+                          longs == 2 ? snprintf(dst, room, conv, (unsigned long long)arg->u) :
+                          longs == 1 ? snprintf(dst, room, conv, (unsigned long)arg->u) :
+                          snprintf(dst, room, conv, (unsigned)arg->u);
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+                written = snprintf(dst, room, conv, arg->f);
+                break;
+            case 'p':
+                written = snprintf(dst, room, conv, arg->p);
+                break;
+            case 's':
+                written = snprintf(dst, room, conv, rec->strings + arg->str);
                 break;
-            }
         }
+        p++;
+        if (written > 0) len += (size_t)written < room ? (size_t)written : room - 1;
     }
-    
-    pthread_mutex_unlock(&data_mutex);
+    out[len] = '\0';
+    return len;
 }
 
-// --- Thread de Simulação de Tempo ---
-void* time_simulator_thread(void* arg) {
+// Anel da thread atual, criado na primeira mensagem (NULL sem memória: a mensagem perde-se)
+LogRing* log_local() {
+    if (log_ring == NULL) {
+        LogRing* ring = calloc(1, sizeof(LogRing));
+        if (ring == NULL) return NULL;
+        pthread_mutex_lock(&log_rings_mutex);
+        ring->next = log_rings;
+        log_rings = ring;
+        pthread_mutex_unlock(&log_rings_mutex);
+        log_ring = ring;
+    }
+    return log_ring;
+}
+
+// --- Thread de Log (dorme até haver registos; a espera limitada é só uma rede de segurança) ---
+// Um anel que ganhou registos durante a drenagem não acordou ninguém (não estava
+// vazio), mas ainda tem registos quando se volta a verificar e é drenado logo.
+void* log_thread(void* arg) {
     while (keep_running) {
-        sleep(1);
-        pthread_mutex_lock(&data_mutex);
-        simulated_time++;
-        pthread_mutex_unlock(&data_mutex);
+        pthread_mutex_lock(&log_wake_mutex);
+        if (!log_has_records()) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += LOG_IDLE_WAIT_MS / 1000;
+            deadline.tv_nsec += (LOG_IDLE_WAIT_MS % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&log_wake_cond, &log_wake_mutex, &deadline);
+        }
+        pthread_mutex_unlock(&log_wake_mutex);
+        log_drain();
     }
     return NULL;
 }
 
-// --- Comandos Administrativos ---
-void cmd_listar() {
-    printf("[CONTROLADOR] == SERVIÇOS AGENDADOS ==\n");
-    pthread_mutex_lock(&data_mutex);
-    
-    int count = 0;
-    for (int i = 0; i < num_services; i++) {
-        if (services[i].status == STATUS_SCHEDULED || services[i].status == STATUS_IN_PROGRESS) {
-            const char* status_str = (services[i].status == STATUS_SCHEDULED) ? "AGENDADO" : "EM CURSO";
-            printf("  [ID:%d] %s -> %s | Cliente: %s | Veículo: %d | Status: %s\n",
-                services[i].id, services[i].origem, services[i].destino,
-                services[i].client_name, services[i].vehicle_id, status_str);
-            count++;
+// Algum anel com registos por drenar
+int log_has_records() {
+    pthread_mutex_lock(&log_rings_mutex);
+    LogRing* first = log_rings;
+    pthread_mutex_unlock(&log_rings_mutex);
+
+    for (LogRing* ring = first; ring != NULL; ring = ring->next) {
+        if (atomic_load_explicit(&ring->head, memory_order_acquire) !=
+            atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+            return 1;
         }
     }
-    
-    if (count == 0) {
-        printf("  (Nenhum serviço agendado ou em curso)\n");
-    }
-    
-    pthread_mutex_unlock(&data_mutex);
+    return 0;
 }
 
-void cmd_utiliz() {
-    printf("[CONTROLADOR] == UTILIZADORES LIGADOS (%d / %d) ==\n", num_clients, MAX_CLIENTS);
-    pthread_mutex_lock(&data_mutex);
-    
-    for (int i = 0; i < num_clients; i++) {
-        const char* status = (clients[i].status == CLIENT_ON_TRIP) ? "EM VIAGEM" : "À ESPERA";
-        printf("  - %s (PID: %d) [%s]\n", clients[i].name, clients[i].pid, status);
-    }
-    
-    if (num_clients == 0) {
-        printf("  (Nenhum utilizador ligado)\n");
+// --- Drenar Todos os Anéis (um lote ordenado por tempo, um fflush) ---
+void log_drain() {
+    pthread_mutex_lock(&log_drain_mutex);
+    pthread_mutex_lock(&log_rings_mutex);
+    LogRing* first = log_rings;
+    pthread_mutex_unlock(&log_rings_mutex);
+
+    size_t num_rings = 0;
+    for (LogRing* ring = first; ring != NULL; ring = ring->next) num_rings++;
+    if (num_rings * LOG_RING_SIZE > log_batch_capacity) {
+        size_t new_capacity = num_rings * LOG_RING_SIZE;
+        LogRecord** new_batch = realloc(log_batch, new_capacity * sizeof(LogRecord*));
+        if (new_batch == NULL) {
+            pthread_mutex_unlock(&log_drain_mutex);
+            return;  // Sem memória: os registos esperam pela próxima drenagem
+        }
+        log_batch = new_batch;
+        log_batch_capacity = new_capacity;
     }
-    
-    pthread_mutex_unlock(&data_mutex);
-}
 
-void cmd_frota() {
-    printf("[CONTROLADOR] == ESTADO DA FROTA ==\n");
-    pthread_mutex_lock(&data_mutex);
-    
-    for (int i = 0; i < num_vehicles; i++) {
-        if (vehicles[i].available == VEHICLE_AVAILABLE) {
-            printf("  [Veículo %d] DISPONÍVEL\n", vehicles[i].id);
-        } else {
-            printf("  [Veículo %d] EM SERVIÇO - Progresso: %d%% (Serviço ID: %d)\n",
-                vehicles[i].id, vehicles[i].progress_percent, vehicles[i].service_id);
+    // O que chegar depois de fotografar o head fica para a próxima drenagem
+    size_t count = 0;
+    uint64_t dropped = 0;
+    for (LogRing* ring = first; ring != NULL; ring = ring->next) {
+        ring->drain_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        for (uint32_t i = tail; i != ring->drain_head; i++) {
+            log_batch[count++] = &ring->records[i % LOG_RING_SIZE];
         }
+        uint64_t ring_dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        dropped += ring_dropped - ring->dropped_reported;
+        ring->dropped_reported = ring_dropped;
     }
-    
-    pthread_mutex_unlock(&data_mutex);
-}
 
-void cmd_cancelar(int service_id) {
-    pthread_mutex_lock(&data_mutex);
-    
-    if (service_id == 0) {
-        int cancelled = 0;
-        for (int i = 0; i < num_services; i++) {
-            if (services[i].status == STATUS_SCHEDULED || services[i].status == STATUS_IN_PROGRESS) {
-                services[i].status = STATUS_CANCELLED;
-                
-                for (int c = 0; c < num_clients; c++) {
-                    if (clients[c].pid == services[i].client_pid) {
-                        clients[c].status = CLIENT_WAITING;
-                        break;
-                    }
-                }
-                
-                if (services[i].vehicle_id > 0) {
-                    for (int v = 0; v < num_vehicles; v++) {
-                        if (vehicles[v].id == services[i].vehicle_id) {
-                            vehicles[v].available = VEHICLE_AVAILABLE;
-                            vehicles[v].progress_percent = 0;
-                            vehicles[v].service_id = -1;
-                            
-                            if (vehicles[v].process_pid > 0) {
-                                kill(vehicles[v].process_pid, SIGUSR1);
-                                vehicles[v].process_pid = 0;
-                            }
-                            break;
-                        }
-                    }
-                }
-                
-                send_response(services[i].client_pid, 0, "Serviço cancelado");
-                cancelled++;
-            }
+    if (count > 0 || dropped > 0) {
+        qsort(log_batch, count, sizeof(LogRecord*), log_record_cmp);
+        int to_terminal = 0;
+        for (size_t i = 0; i < count; i++) {
+            to_terminal |= log_emit(log_batch[i]);
         }
-        printf("[CONTROLADOR] %d serviço(s) cancelado(s).\n", cancelled);
-    } else {
-        int found = 0;
-        for (int i = 0; i < num_services; i++) {
-            if (services[i].id == service_id && 
-                (services[i].status == STATUS_SCHEDULED || services[i].status == STATUS_IN_PROGRESS)) {
-                services[i].status = STATUS_CANCELLED;
-                found = 1;
-                
-                // Atualizar cliente
-                for (int c = 0; c < num_clients; c++) {
-                    if (clients[c].pid == services[i].client_pid) {
-                        clients[c].status = CLIENT_WAITING;
-                        break;
-                    }
-                }
-                
-                if (services[i].vehicle_id > 0) {
-                    for (int v = 0; v < num_vehicles; v++) {
-                        if (vehicles[v].id == services[i].vehicle_id) {
-                            vehicles[v].available = VEHICLE_AVAILABLE;
-                            vehicles[v].progress_percent = 0;
-                            vehicles[v].service_id = -1;
-                            
-                            if (vehicles[v].process_pid > 0) {
-                                kill(vehicles[v].process_pid, SIGUSR1);
-                                vehicles[v].process_pid = 0;
-                            }
-                            break;
-                        }
-                    }
-                }
-                
-                send_response(services[i].client_pid, 0, "Serviço cancelado");
-                printf("[CONTROLADOR] Serviço ID %d cancelado.\n", service_id);
-                break;
-            }
+        if (dropped > 0) {
+            LogRecord rec;
+            rec.time_ns = stats_now_ns();
+            rec.level = LOG_WARN;
+            rec.fmt = "%llu mensagens de log perdidas (anel cheio)";
+            rec.num_args = 1;
+            rec.args[0].u = dropped;
+            to_terminal |= log_emit(&rec);
         }
-        
-        if (!found) {
-            printf("[CONTROLADOR] Serviço ID %d não encontrado ou já finalizado.\n", service_id);
+        if (log_file != NULL) {
+            fflush(log_file);
+        }
+        // O prompt só é reposto se alguma linha o apagou
+        if (to_terminal) {
+            printf("CMD> ");
+            fflush(stdout);
         }
     }
-    
-    pthread_mutex_unlock(&data_mutex);
+
+    // Só agora os produtores podem reutilizar as posições escritas
+    for (LogRing* ring = first; ring != NULL; ring = ring->next) {
+        atomic_store_explicit(&ring->tail, ring->drain_head, memory_order_release);
+    }
+    pthread_mutex_unlock(&log_drain_mutex);
 }
 
-void cmd_km() {
-    pthread_mutex_lock(&data_mutex);
-    
-    double total_km = 0.0;
-    for (int i = 0; i < num_vehicles; i++) {
-        total_km += vehicles[i].total_km;
+int log_record_cmp(const void* a, const void* b) {
+    const LogRecord* ra = *(const LogRecord* const*)a;
+    const LogRecord* rb = *(const LogRecord* const*)b;
+    if (ra->time_ns != rb->time_ns) return ra->time_ns < rb->time_ns ? -1 : 1;
+    return 0;
+}
+
+// --- Escrever um Registo (chamar com log_drain_mutex; 1 se foi para o terminal) ---
+int log_emit(const LogRecord* rec) {
+    static const char* const terminal_prefix[] = {
+        "[DEBUG] ", "[CONTROLADOR] ", "[CONTROLADOR] AVISO: ", "[CONTROLADOR] Erro: "
+    };
+    static const char* const level_name[] = { "DEBUG", "INFO", "AVISO", "ERRO" };
+
+    char text[LOG_TEXT_MAX];
+    int len = (int)log_format(rec, text, sizeof(text));
+
+    if (log_file == NULL) {
+        printf("\r\033[K%s%.*s\n", terminal_prefix[rec->level], len, text);
+        return 1;
     }
-    
-    printf("[CONTROLADOR] Quilómetros totais percorridos: %.2f km\n", total_km);
-    
-    pthread_mutex_unlock(&data_mutex);
+
+    if (log_rotate_bytes > 0 && log_file_bytes >= log_rotate_bytes) {
+        log_rotate();
+        if (log_file == NULL) {
+            return log_emit(rec);
+        }
+    }
+
+    int64_t wall_ns = (int64_t)rec->time_ns + log_clock_offset_ns;
+    time_t secs = (time_t)(wall_ns / 1000000000ll);
+    struct tm tm;
+    char date[32];
+    localtime_r(&secs, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+    int written = fprintf(log_file, "%s.%03d %-5s %.*s\n", date, (int)(wall_ns % 1000000000ll / 1000000),
+                          level_name[rec->level], len, text);
+    if (written > 0) log_file_bytes += written;
+    return 0;
 }
 
-void cmd_hora() {
-    pthread_mutex_lock(&data_mutex);
-    
-    int hours = simulated_time / 3600;
-    int minutes = (simulated_time % 3600) / 60;
-    int seconds = simulated_time % 60;
-    
-    printf("[CONTROLADOR] Tempo simulado: %02d:%02d:%02d (%d segundos)\n", hours, minutes, seconds, simulated_time);
-    
-    pthread_mutex_unlock(&data_mutex);
+// --- Rodar o Ficheiro de Log (ficheiro -> .1 -> .2 ...; o mais antigo é apagado) ---
+void log_rotate() {
+    fclose(log_file);
+    char from[PATH_MAX + 16], to[PATH_MAX + 16];
+    for (int i = LOG_ROTATE_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", log_path, i);
+        snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", log_path);
+    rename(log_path, to);
+
+    log_file = fopen(log_path, "we");
+    log_file_bytes = 0;
+    if (log_file == NULL) {
+        perror("[CONTROLADOR] Erro ao rodar LOG_FICHEIRO (a escrever no terminal)");
+    }
 }
 
 // --- Admin ---
@@ -926,32 +5063,80 @@ void process_admin_commands() {
         else if (strcmp(buffer, "hora") == 0) {
             cmd_hora();
         }
+        else if (strcmp(buffer, "historico") == 0) {
+            cmd_historico(NULL);
+        }
+        else if (strncmp(buffer, "historico ", 10) == 0) {
+            cmd_historico(buffer + 10);
+        }
+        else if (strcmp(buffer, "stats") == 0) {
+            cmd_stats();
+        }
         else if (strlen(buffer) > 0) {
             printf("[CONTROLADOR] Comando desconhecido. Comandos disponíveis:\n");
-            printf("  listar, utiliz, frota, cancelar <id>, km, hora, terminar\n");
+            printf("  listar, utiliz, frota, cancelar <id>, km, hora, historico [cliente], stats, terminar\n");
         }
     }
 }
 
+// --- Thread de Sinais: CTRL+C encerra como o comando "terminar" ---
+void* signal_thread(void* arg) {
+    sigset_t int_set;
+    sigemptyset(&int_set);
+    sigaddset(&int_set, SIGINT);
+    int sig;
+    while (sigwait(&int_set, &sig) != 0);
+    cleanup_and_exit(sig);
+    return NULL;
+}
+
 // --- Limpeza e Saída ---
+// Pode ser chamada pela main e pela thread de sinais ao mesmo tempo: a segunda
+// fica à espera no mutex (nunca libertado) até o processo terminar.
 void cleanup_and_exit(int signal) {
+    pthread_mutex_lock(&shutdown_mutex);
+
     if (keep_running) {
         printf("\n[CONTROLADOR] A terminar sistema...\n");
     }
 
+    // Com o mutex do scheduler: entre testar a condição e adormecer não perde o aviso
+    pthread_mutex_lock(&scheduler_mutex);
     keep_running = 0;
+    scheduler_signalled = 1;
+    pthread_cond_signal(&scheduler_cond);
+    pthread_mutex_unlock(&scheduler_mutex);
 
     unlink(PIPE_SERVER);
     
-    // Fechar pipes de telemetria
-    if (telemetry_pipe_read != -1) {
-        close(telemetry_pipe_read);
-    }
+    // Acordar a thread de telemetria (bloqueada no epoll) e fechar o pipe
     if (telemetry_pipe_write != -1) {
-        close(telemetry_pipe_write);
+        int fd = telemetry_pipe_write;
+        telemetry_pipe_write = -1;
+        write(fd, "x", 1);
+        close(fd);
+    }
+
+    // Os veículos terminam sozinhos quando o pipe de comandos fecha (EOF no stdin)
+    for (int i = 0; i < vehicle_table.high_water && !internal_simulation && telemetry_shm == NULL; i++) {
+        char pipe_path[50];
+        sprintf(pipe_path, PIPE_VEHICLE_FMT, vehicles[i].id);
+        unlink(pipe_path);
+    }
+    if (telemetry_shm != NULL) {
+        shm_unlink(telemetry_shm_name);
+    }
+    if (archive_fd != -1 && wal_fd == -1) {
+        unlink(archive_path);  // Arquivo temporário: sem DIR_ESTADO o histórico não sobrevive
+    }
+    if (metrics_fd != -1) {
+        unlink(metrics_path);
     }
     
+    wal_close();
     broadcast_shutdown();
+    write_responses();  // Entregar já (a thread de escrita pode já não correr)
+    log_drain();
     printf("[CONTROLADOR] Encerrado.\n");
     exit(0);
 }
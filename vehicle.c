@@ -1,113 +1,160 @@
 #include "common/data.h"
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
 
 // --- Variáveis Globais ---
-volatile int running = 1;
-volatile int service_cancelled = 0;
+int running = 1;            // 0 quando o controlador fecha o pipe de comandos
+int service_cancelled = 0;
 int vehicle_id;
 char local_partida[100];
 double distancia_km;
 int client_pid;
 int service_id;
 int telemetry_fd = -1;
-
-// --- Handlers ---
-void trata_sinal(int sinal) {
-    if (sinal == SIGUSR1) {
-        service_cancelled = 1;
-        running = 0;
-    }
-}
+double time_speed = 1.0;    // SIM_SPEED herdado do controlador
+TelemetryRing* telemetry_ring = NULL;    // Modo TELEMETRIA_SHM: anel deste veículo
+_Atomic uint64_t* telemetry_dirty = NULL;
+int telemetry_event_fd = -1;
 
 // --- Protótipos ---
+void run_trip(const TripAssignment* trip);
+void wait_step(long step_ms);
+void read_command();
 void contact_client();
-void send_telemetry(const char* message);
+void send_telemetry(uint8_t event, int percent, double km);
 void open_telemetry_pipe();
+int open_telemetry_ring(const char* shm_name, int event_fd);
 void close_telemetry_pipe();
 
 // --- Main ---
 int main(int argc, char *argv[]) {
-    // Argumentos: ./veiculo <id> <service_id> <client_pid> <local_partida> <distancia_km>
-    if (argc != 6) {
-        fprintf(stderr, "[VEICULO] Erro: Uso ./veiculo <id> <service_id> <client_pid> <local> <distancia>\n");
+    // Argumentos: ./veiculo <id> [<memória partilhada> <eventfd>]
+    // As viagens chegam como frames pelo stdin (pipe de comandos do controlador)
+    if (argc != 2 && argc != 4) {
+        fprintf(stderr, "[VEICULO] Erro: Uso ./veiculo <id> [<shm> <eventfd>]\n");
         return 1;
     }
 
     vehicle_id = atoi(argv[1]);
-    service_id = atoi(argv[2]);
-    client_pid = atoi(argv[3]);
-    strcpy(local_partida, argv[4]);
-    distancia_km = atof(argv[5]);
-
-    // Configurar Sinais
-    signal(SIGUSR1, trata_sinal);
-    
+    if (getenv("SIM_SPEED") != NULL && atof(getenv("SIM_SPEED")) > 0) {
+        time_speed = atof(getenv("SIM_SPEED"));
+    }
+
+    // Abrir transporte de telemetria (fica aberto entre viagens)
+    if (argc == 4) {
+        if (open_telemetry_ring(argv[2], atoi(argv[3])) == -1) {
+            fprintf(stderr, "[VEICULO %d] Erro: Memória partilhada de telemetria indisponível\n", vehicle_id);
+            return 1;
+        }
+    } else {
+        open_telemetry_pipe();
+    }
+
+    while (running) {
+        FrameHeader hdr;
+        TripAssignment trip;
+        ssize_t len = frame_read(STDIN_FILENO, &hdr, &trip, sizeof(trip));
+        if (len == -1) break;  // Controlador terminou
+
+        // Cancelamentos com o veículo parado referem-se a viagens já concluídas
+        if (hdr.opcode == OP_VEHICLE_ASSIGN && len == sizeof(trip)) {
+            run_trip(&trip);
+        }
+    }
+
+    close_telemetry_pipe();
+    return 0;
+}
+
+// --- Executar Viagem ---
+void run_trip(const TripAssignment* trip) {
+    service_id = trip->service_id;
+    client_pid = trip->client_pid;
+    distancia_km = trip->distance_km;
+    snprintf(local_partida, sizeof(local_partida), "%s", trip->origem);
+    service_cancelled = 0;
+
     printf("\r\033[K[VEICULO %d] Iniciado para serviço ID %d (%.1f km)\nCMD> ", vehicle_id, service_id, distancia_km);
     fflush(stdout);
 
-    // Abrir pipe de telemetria
-    open_telemetry_pipe();
-
     // 1. Contactar cliente (chegou ao local de partida) e viagem inicia automaticamente
     contact_client();
-    
-    if (!running) {
-        send_telemetry("CANCELLED");
-        close_telemetry_pipe();
-        return 0;
-    }
 
     // 2. Cliente entra automaticamente - enviar notificação
-    char start_msg[256];
-    sprintf(start_msg, "TRIP_STARTED|%d|%d", vehicle_id, service_id);
-    send_telemetry(start_msg);
-    
-    if (!running) {
-        send_telemetry("CANCELLED");
-        close_telemetry_pipe();
-        return 0;
-    }
+    send_telemetry(TELEMETRY_TRIP_STARTED, 0, 0.0);
 
     // 3. Simular viagem
     int percent = 0;
-    double time_per_step = distancia_km / 10.0; 
-    
-    while (running && percent < 100) {
-        sleep((int)time_per_step);
-        
-        if (!running) break;
-        
+    // 1 km por segundo simulado, convertido para milissegundos reais
+    long step_ms = (long)(distancia_km / 10.0 * 1000 / time_speed);
+
+    while (running && !service_cancelled && percent < 100) {
+        wait_step(step_ms);
+
+        if (!running || service_cancelled) break;
+
         percent += 10;
         printf("\r\033[K[VEICULO %d] Progresso: %d%%\nCMD> ", vehicle_id, percent);
         fflush(stdout);
-        
-        // Enviar progresso ao controlador
-        char progress_msg[256];
-        sprintf(progress_msg, "PROGRESS|%d|%d|%d", vehicle_id, service_id, percent);
-        send_telemetry(progress_msg);
-        
-        // Enviar quilómetros percorridos
-        double km_done = (percent / 100.0) * distancia_km;
-        char km_msg[256];
-        
-        sprintf(km_msg, "DISTANCE|%d|%d|%.2f", vehicle_id, service_id, km_done);
-        send_telemetry(km_msg);
+
+        // Enviar progresso e quilómetros percorridos (o último passo vai no COMPLETED)
+        if (percent < 100) {
+            send_telemetry(TELEMETRY_PROGRESS, percent, (percent / 100.0) * distancia_km);
+        }
     }
 
     // 4. Reportar conclusão
-    if (service_cancelled) {
+    if (service_cancelled || !running) {
         printf("\r\033[K[VEICULO %d] Serviço cancelado (progresso: %d%%)\nCMD> ", vehicle_id, percent);
         fflush(stdout);
-        send_telemetry("CANCELLED");
-    } else if (percent >= 100) {
+        send_telemetry(TELEMETRY_CANCELLED, percent, (percent / 100.0) * distancia_km);
+    } else {
         printf("\r\033[K[VEICULO %d] Viagem concluída! Total: %.1f km\nCMD> ", vehicle_id, distancia_km);
         fflush(stdout);
-        char complete_msg[256];
-        sprintf(complete_msg, "COMPLETED|%d|%d|%.1f", vehicle_id, service_id, distancia_km);
-        send_telemetry(complete_msg);
+        send_telemetry(TELEMETRY_COMPLETED, 100, distancia_km);
+    }
+}
+
+// --- Esperar um Passo da Viagem (interrompido por comandos) ---
+void wait_step(long step_ms) {
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += step_ms / 1000;
+    deadline.tv_nsec += (step_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (running && !service_cancelled) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining_ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+                            (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (remaining_ms < 0) remaining_ms = 0;
+
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        int r = poll(&pfd, 1, (int)remaining_ms);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) return;  // Passo concluído (ou erro: seguir viagem)
+
+        read_command();
+    }
+}
+
+// --- Ler Comando Durante a Viagem ---
+void read_command() {
+    FrameHeader hdr;
+    int32_t target;
+    ssize_t len = frame_read(STDIN_FILENO, &hdr, &target, sizeof(target));
+    if (len == -1) {
+        running = 0;
+        return;
+    }
+
+    if (hdr.opcode == OP_VEHICLE_CANCEL && len == sizeof(target) && target == service_id) {
+        service_cancelled = 1;
     }
-    
-    close_telemetry_pipe();
-    return 0;
 }
 
 // --- Contactar Cliente ---
@@ -118,11 +165,10 @@ void contact_client() {
     // Tentar contactar cliente via pipez
     int fd = open(pipe_client_path, O_WRONLY | O_NONBLOCK);
     if (fd != -1) {
-        ControllerResponse msg;
-        msg.success = 1;
-        sprintf(msg.message, "Veículo %d chegou a '%s'. A viagem está a iniciar!", 
-                vehicle_id, local_partida);
-        write(fd, &msg, sizeof(ControllerResponse));
+        char msg[BUFFER_SIZE];
+        int len = snprintf(msg, sizeof(msg), "Veículo %d chegou a '%s'. A viagem está a iniciar!",
+                           vehicle_id, local_partida);
+        frame_write(fd, OP_RESPONSE, FRAME_F_SUCCESS, getpid(), msg, len);
         close(fd);
         printf("\r\033[K[VEICULO %d] Cliente contactado (PID: %d)\nCMD> ", vehicle_id, client_pid);
     } else {
@@ -135,20 +181,43 @@ void contact_client() {
 void open_telemetry_pipe() {
     char pipe_path[50];
     sprintf(pipe_path, PIPE_VEHICLE_FMT, vehicle_id);
-    
-    // Tentar abrir em modo bloqueante primeiro (aguarda leitor)
-    // Se falhar, tentar não-bloqueante
+
+    // O controlador abre o lado de leitura antes de lançar o veículo
     telemetry_fd = open(pipe_path, O_WRONLY);
     if (telemetry_fd == -1) {
-        // Se falhar em modo bloqueante, tentar não-bloqueante
-        telemetry_fd = open(pipe_path, O_WRONLY | O_NONBLOCK);
-        if (telemetry_fd == -1) {
-            printf("\r\033[K[VEICULO %d] AVISO: Não foi possível abrir pipe de telemetria\nCMD> ", vehicle_id);
-            fflush(stdout);
-        }
+        printf("\r\033[K[VEICULO %d] AVISO: Não foi possível abrir pipe de telemetria\nCMD> ", vehicle_id);
+        fflush(stdout);
     }
 }
 
+// --- Mapear Anel de Telemetria (memória partilhada criada pelo controlador) ---
+int open_telemetry_ring(const char* shm_name, int event_fd) {
+    int fd = shm_open(shm_name, O_RDWR, 0);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(TelemetryShmHeader)) {
+        close(fd);
+        return -1;
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    // O anel de cada veículo é o do seu slot (id - 1)
+    uint32_t ring_idx = vehicle_id - 1;
+    uint32_t num_rings = ((TelemetryShmHeader*)base)->num_rings;
+    if (ring_idx >= num_rings || telemetry_shm_size(num_rings) > (size_t)st.st_size) {
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    telemetry_ring = telemetry_shm_ring(base, ring_idx);
+    telemetry_dirty = &telemetry_shm_dirty(base)[ring_idx / 64];
+    telemetry_event_fd = event_fd;
+    return 0;
+}
+
 // --- Fechar Pipe de Telemetria ---
 void close_telemetry_pipe() {
     if (telemetry_fd != -1) {
@@ -158,9 +227,31 @@ void close_telemetry_pipe() {
 }
 
 // --- Enviar Telemetria ---
-void send_telemetry(const char* message) {
-    if (telemetry_fd != -1) {
-        write(telemetry_fd, message, strlen(message));
-        write(telemetry_fd, "\n", 1);
+void send_telemetry(uint8_t event, int percent, double km) {
+    TelemetryRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.vehicle_id = vehicle_id;
+    rec.service_id = service_id;
+    rec.km = km;
+    rec.event = event;
+    rec.percent = (uint8_t)percent;
+
+    if (telemetry_ring != NULL) {
+        // Escrever diretamente no anel; só o controlador avança o tail
+        uint32_t head = atomic_load_explicit(&telemetry_ring->head, memory_order_relaxed);
+        while (head - atomic_load_explicit(&telemetry_ring->tail, memory_order_acquire) >= TELEMETRY_RING_SIZE) {
+            usleep(1000);  // Anel cheio: o controlador já foi acordado, esperar que drene
+        }
+        telemetry_ring->records[head % TELEMETRY_RING_SIZE] = rec;
+        atomic_store_explicit(&telemetry_ring->head, head + 1, memory_order_release);
+
+        // Acordar o controlador só se o anel ainda não estava marcado
+        uint64_t bit = 1ull << ((vehicle_id - 1) % 64);
+        if (!(atomic_fetch_or(telemetry_dirty, bit) & bit)) {
+            uint64_t one = 1;
+            write(telemetry_event_fd, &one, sizeof(one));
+        }
+    } else if (telemetry_fd != -1) {
+        write(telemetry_fd, &rec, sizeof(rec));
     }
-}
\ No newline at end of file
+}